@@ -0,0 +1,39 @@
+#ifndef _BACKEND_H
+#define _BACKEND_H
+
+#include <stdint.h>
+
+// access patterns a backend may tune for
+#define IO_HINT_WILLNEED 1
+#define IO_HINT_SEQUENTIAL 2
+#define IO_HINT_DONTNEED 3
+
+// one of several ranges read at once
+typedef struct sector_run_s {
+        int64_t start_sector;
+        unsigned int num_sectors;
+        void *buf;
+} sector_run_t;
+
+// how the sectors of the image are stored. Every backend works on the one
+// opened image, positions and sizes count sectors.
+typedef struct backend_s {
+        const char *name;
+        int (*open)(int fd); // -1 when it cannot serve fd
+        void (*read)(int64_t start_sector, unsigned int num_sectors, void *into);
+        void (*readv)(sector_run_t *runs, int count);
+        void (*write)(int64_t start_sector, unsigned int num_sectors, const void *from);
+        int (*flush)(void);
+        int64_t (*size)(void);
+        void (*hint)(int64_t start_sector, int64_t num_sectors, int advice);
+        void (*close)(void);
+} backend_t;
+
+extern const backend_t pread_backend;
+extern const backend_t mmap_backend;
+extern const backend_t memory_backend;
+
+const backend_t *find_backend(const char *name);
+int sectors_in_hole(int64_t start_sector, unsigned int num_sectors);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef _CHUNKED_H
+#define _CHUNKED_H
+
+#include <stdint.h>
+
+#include "backend.h"
+
+extern const backend_t chunked_backend;
+
+int64_t chunked_probe(const char *path);
+int chunked_open(int fd);
+void chunked_read(int64_t start_sector, unsigned int num_sectors, void *into);
+void chunked_close(void);
+int chunked_convert(const char *src, const char *dst, unsigned int chunk_size);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef _CLONE_H
+#define _CLONE_H
+
+#define CLONE_REFLINK 1
+#define CLONE_SPARSE_COPY 2
+
+int clone_image(const char *src, const char *dst);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef _DCACHE_H
+#define _DCACHE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "ext2_fs.h"
+
+// returned by dcache_lookup() when the cache knows nothing about a name
+#define DCACHE_MISS -1
+
+// a cached directory entry, inode 0 for a name known to be absent
+typedef struct dentry_s {
+        int parent;
+        uint32_t hash;
+        int inode;
+        int rec_len;
+        int file_type;
+        int name_len;
+        uint32_t gen; // generation of the parent when cached
+        struct dentry_s *next;
+        char name[];
+}dentry_t;
+
+// directory entries keyed by (parent inode, name hash)
+typedef struct dcache_s {
+        pthread_mutex_t lock;
+        dentry_t **buckets;
+        int bucket_count;
+        // bumped to invalidate the directories hashing to a slot
+        uint32_t *gens;
+        int len;
+        int cap; // everything is dropped when it fills up
+}dcache_t;
+
+dcache_t *dcache_new(int cap);
+int dcache_lookup(dcache_t *dc, int parent, const char *name, int name_len,
+                  struct ext2_dir_entry_2 *ret);
+void dcache_insert(dcache_t *dc, int parent, struct ext2_dir_entry_2 *dir);
+void dcache_insert_negative(dcache_t *dc, int parent, const char *name, int name_len);
+void dcache_invalidate(dcache_t *dc, int parent);
+void dcache_delete(dcache_t *dc);
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef _DISK_H
 #define _DISK_H
 
+#include "dcache.h"
 #include "ext2_fs.h"
 
 // struct for one block group
@@ -8,9 +9,14 @@ typedef struct group_s {
         int id;
         struct ext2_group_desc *desc;
         char *block_bitmap;
+        char *bitmap_dirty; // sectors of block_bitmap changed since written
         char *inode_bitmap;
         int entry_count;
-        struct ext2_inode **inode_table;
+        struct ext2_inode **inode_table; // NULL while out of the window
+        char *inode_blocks; // the table as read, inode_table points into it
+        char *inode_dirty; // table sectors changed since they were written
+        int referenced; // used since the window clock last passed
+        int pins; // entries held through pin_inode_entry(), never evicted
 }group_t;
 
 // struct for one partition
@@ -22,6 +28,19 @@ typedef struct partition_s {
 
         int group_count;
         group_t **groups;
+
+        // descriptors and bitmaps of every group, the groups point into them
+        struct ext2_group_desc *descs;
+        char *bitmaps;
+        char *bitmaps_dirty;
+
+        // groups whose inode table is resident, 0 keeps every table loaded
+        int window_size;
+        int *window;
+        int window_hand;
+        int window_last; // most recently used group, never evicted
+
+        dcache_t *dcache;
 }partition_t;
 
 // struct for the disk
@@ -33,6 +52,11 @@ typedef struct disk_s {
 // open a disk
 int open_disk(char *path, disk_t *disk, int fix_partition);
 int is_ext2_partition(partition_t *pt);
+int write_group_desc_table(partition_t *pt);
+int write_super_block(partition_t *pt);
+struct ext2_inode ** get_inode_table(partition_t *pt, int group_id);
+int flush_inode_tables(partition_t *pt);
+int flush_block_bitmaps(partition_t *pt);
 int free_disk(disk_t *disk);
 
 #endif
@@ -207,6 +207,7 @@ struct ext2_group_desc
 #define EXT2_ECOMPR_FL                  0x00000800 /* Compression error */
 /* End compression flags --- maybe not all used */
 #define EXT2_BTREE_FL                   0x00001000 /* btree format dir */
+#define EXT2_INDEX_FL                   0x00001000 /* hash-indexed directory */
 #define EXT2_RESERVED_FL                0x80000000 /* reserved for ext2 lib */
 
 #define EXT2_FL_USER_VISIBLE            0x00001FFF /* User visible flags */
@@ -401,9 +402,36 @@ struct ext2_super_block {
     __u8    s_prealloc_blocks;      /* Nr of blocks to try to preallocate*/
     __u8    s_prealloc_dir_blocks;  /* Nr to preallocate for dirs */
     __u16   s_padding1;
-    __u32   s_reserved[204];        /* Padding to the end of the block */
+    /*
+     * Journaling support valid if EXT3_FEATURE_COMPAT_HAS_JOURNAL set.
+     */
+    __u8    s_journal_uuid[16];     /* uuid of journal superblock */
+    __u32   s_journal_inum;         /* inode number of journal file */
+    __u32   s_journal_dev;          /* device number of journal file */
+    __u32   s_last_orphan;          /* start of list of inodes to delete */
+    __u32   s_hash_seed[4];         /* HTREE hash seed */
+    __u8    s_def_hash_version;     /* Default hash version to use */
+    __u8    s_jnl_backup_type;
+    __u16   s_desc_size;            /* size of group descriptor */
+    __u32   s_default_mount_opts;
+    __u32   s_first_meta_bg;        /* First metablock block group */
+    __u32   s_mkfs_time;            /* When the filesystem was created */
+    __u32   s_jnl_blocks[17];       /* Backup of the journal inode */
+    __u32   s_blocks_count_hi;      /* Blocks count high 32 bits */
+    __u32   s_r_blocks_count_hi;    /* Reserved blocks count high 32 bits */
+    __u32   s_free_blocks_hi;       /* Free blocks count high 32 bits */
+    __u16   s_min_extra_isize;      /* All inodes have at least # bytes */
+    __u16   s_want_extra_isize;     /* New inodes should reserve # bytes */
+    __u32   s_flags;                /* Miscellaneous flags */
+    __u32   s_reserved[167];        /* Padding to the end of the block */
 };
 
+/*
+ * Miscellaneous superblock flags
+ */
+#define EXT2_FLAGS_SIGNED_HASH          0x0001  /* Signed dirhash in use */
+#define EXT2_FLAGS_UNSIGNED_HASH        0x0002  /* Unsigned dirhash in use */
+
 #ifdef __KERNEL__
 #define EXT2_SB(sb)     (&((sb)->u.ext2_sb))
 #else
@@ -0,0 +1,22 @@
+#ifndef _HTREE_H
+#define _HTREE_H
+
+#include "ext2_fs.h"
+#include "util/partition.h"
+
+// directory hash versions, as stored in the dx_root
+#define DX_HASH_LEGACY              0
+#define DX_HASH_HALF_MD4            1
+#define DX_HASH_TEA                 2
+#define DX_HASH_LEGACY_UNSIGNED     3
+#define DX_HASH_HALF_MD4_UNSIGNED   4
+#define DX_HASH_TEA_UNSIGNED        5
+
+// returned by htree_find_child() when the index cannot answer
+#define HTREE_UNUSABLE -1
+
+int ext2_dirhash(int version, const char *name, int len, const __u32 *seed, __u32 *ret_hash);
+int htree_find_child(partition_t *pt, int dir_inode, const char *name, int name_len,
+                     struct ext2_dir_entry_2 *ret);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef _LINK_COUNT_H
+#define _LINK_COUNT_H
+
+#include <stdint.h>
+
+// largest count kept in the table, larger ones live in the overflow map
+#define LINK_COUNT_SATURATED 0xFFFF
+
+// reference count of every inode, 16 bits per inode in groups allocated
+// on first use, with a hash map for the rare saturated entries
+typedef struct link_count_s {
+        int group_count;
+        int inodes_per_group;
+        uint16_t **groups;
+        char *in_use; // groups whose inode bitmap is not empty
+
+        // open addressing map from inode to full count
+        int *overflow_keys;
+        int *overflow_counts;
+        int overflow_len;
+        int overflow_cap;
+}link_count_t;
+
+link_count_t *lc_new(int group_count, int inodes_per_group);
+void lc_set_in_use(link_count_t *lc, int group_number);
+int lc_group_active(link_count_t *lc, int group_number);
+void lc_add(link_count_t *lc, int inode, int n);
+int lc_get(link_count_t *lc, int inode);
+void lc_reset(link_count_t *lc);
+void lc_delete(link_count_t *lc);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef _OVERLAY_H
+#define _OVERLAY_H
+
+#include <stdint.h>
+
+#include "backend.h"
+
+int overlay_open(const char *path, int64_t sector_count);
+int overlay_active(void);
+void overlay_read(int64_t start_sector, unsigned int num_sectors, void *into);
+void overlay_write(int64_t start_sector, unsigned int num_sectors, const void *from);
+int overlay_close(void);
+const backend_t *overlay_backend_over(const backend_t *lower);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef _PLAN_H
+#define _PLAN_H
+
+#include <stdint.h>
+
+#include "backend.h"
+
+int plan_init(void);
+int plan_active(void);
+void plan_record(int64_t start_sector, unsigned int num_sectors, const void *from);
+void plan_overlay(int64_t start_sector, unsigned int num_sectors, void *into);
+int plan_sectors(void);
+int plan_writeback(void);
+int plan_apply(const backend_t *io, const char *undo_path);
+int plan_drain(void (*write)(int64_t start_sector, unsigned int num_sectors, const void *from));
+int plan_save(const char *path);
+int plan_load(const char *path);
+void plan_close(void);
+
+#endif
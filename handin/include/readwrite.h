@@ -3,7 +3,17 @@
 
 #include <sys/types.h>
 
+#include "backend.h"
+
+int open_backend(const char *name, int fd);
+void stack_overlay_backend(void);
+void close_backend(void);
+const backend_t *image_backend(void);
+int64_t disk_sector_count(void);
+void hint_sectors(int64_t start_sector, int64_t num_sectors, int advice);
+int flush_sectors(void);
 void read_sectors (int64_t start_sector, unsigned int num_sectors, void *into);
+void read_sectors_v (sector_run_t *runs, int count);
 void write_sectors (int64_t start_sector, unsigned int num_sectors, void *from);
 void print_sector (unsigned char *buf);
 int open_read_close_sect(char *disk, int start_sect, int num_sectors, char *buf);
@@ -0,0 +1,11 @@
+#ifndef _SPILL_H
+#define _SPILL_H
+
+#include <stddef.h>
+
+int spill_init(long long budget);
+void *spill_calloc(size_t count, size_t size);
+void spill_free(void *ptr, size_t size);
+void spill_close(void);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _TRAVERSE_H
+#define _TRAVERSE_H
+
+#include "link_list.h"
+#include "util/partition.h"
+
+int parallel_search(list_t *queue, partition_t *pt,
+                    int (*func)(partition_t*, int),
+                    void (*revisit)(partition_t*, int, int),
+                    char *visited, int workers);
+int traverse_worker_id(void);
+
+#endif
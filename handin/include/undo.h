@@ -0,0 +1,12 @@
+#ifndef _UNDO_H
+#define _UNDO_H
+
+#include <stdint.h>
+
+int undo_open(const char *path);
+void undo_append(int64_t start_sector, unsigned int num_sectors, const void *from);
+void undo_sync(void);
+void undo_close(void);
+int undo_replay(const char *path, int fd);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef _UTIL_BITMAP_H
+#define _UTIL_BITMAP_H
+
+// bitmaps of blocks and inodes, offsets start from 1
+#define MAP_UNIT_SIZE 8
+#define SET_BIT(map, offset) ((map)[((offset)-1) / MAP_UNIT_SIZE] = (map)[((offset)-1) / MAP_UNIT_SIZE] | (0x1 << (((offset)-1) % MAP_UNIT_SIZE)))
+#define CLR_BIT(map, offset) ((map)[((offset)-1) / MAP_UNIT_SIZE] = (map)[((offset)-1) / MAP_UNIT_SIZE] & ~(0x1 << (((offset)-1) % MAP_UNIT_SIZE)))
+
+#define GET_BIT(map, offset) (((map)[((offset)-1) / MAP_UNIT_SIZE] >> (((offset)-1) % MAP_UNIT_SIZE)) & 0x1)
+
+// set a bit and return its old value, atomic so markers may run in parallel
+static inline int test_and_set_bit(char *map, int offset)
+{
+        char mask = 0x1 << ((offset-1) % MAP_UNIT_SIZE);
+        return (__atomic_fetch_or(&map[(offset-1) / MAP_UNIT_SIZE], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+// read a bit that other threads may be setting
+static inline int test_bit(char *map, int offset)
+{
+        return (__atomic_load_n(&map[(offset-1) / MAP_UNIT_SIZE], __ATOMIC_RELAXED) >> ((offset-1) % MAP_UNIT_SIZE)) & 0x1;
+}
+
+#endif
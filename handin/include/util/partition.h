@@ -6,12 +6,16 @@
 
 char * read_block(partition_t *pt, int block_index, int count);
 int write_block(partition_t *pt, int block_index, int count, char *buf);
+int64_t get_block_sector(partition_t *pt, int block_index);
+void hint_blocks(partition_t *pt, int block_index, int count, int advice);
+int write_dirty_sectors(partition_t *pt, int block_index, int count, char *buf, char *dirty);
 
 // get attributes for partition
 int get_number_of_groups(partition_t *pt);
 int get_inodes_per_group(partition_t *pt);
 int get_block_size(partition_t *pt);
 int get_blocks_per_group(partition_t *pt);
+int get_blocks_in_group(partition_t *pt, int group_number);
 
 // get attributes for group
 int get_block_bitmap_bid(group_t *g);
@@ -22,11 +26,19 @@ int get_free_inodes_count(group_t *g);
 
 // get item
 struct ext2_inode * get_inode_entry(partition_t *pt, int inode_id);
+struct ext2_inode * pin_inode_entry(partition_t *pt, int inode_id);
+void unpin_inode_entry(partition_t *pt, int inode_id);
+int mark_inode_dirty(partition_t *pt, int inode_id);
 int get_dir(partition_t *pt, int inode_id, struct ext2_dir_entry_2 *dir);
+int get_parent_inode(partition_t *pt, int inode_id);
 slice_t * get_blocks(partition_t *pt, int inode_id);
+int get_block_id(partition_t *pt, int inode_id, int index);
 slice_t * get_allocated_blocks(partition_t *pt, int inode);
 slice_t * get_child_inodes(partition_t *pt, int inode_id);
 slice_t * get_child_dirs(partition_t *pt, int inode_id);
+int get_block_dirs(partition_t *pt, char *block, slice_t *s);
+int lookup_child(partition_t *pt, int dir_inode, const char *name, int name_len,
+                 struct ext2_dir_entry_2 *ret);
 int get_lost_found_inode(partition_t *pt);
 
 //
@@ -34,6 +46,9 @@ int is_valid_inode(partition_t *pt, int inode);
 int is_dir(partition_t *pt, int inode_id);
 int is_symbol(partition_t *pt, int inode_id);
 int block_allocated(partition_t *pt, int block_number);
+int release_block(partition_t *pt, int block_number);
+int claim_block(partition_t *pt, int block_number);
 int inode_allocated(partition_t *pt, int inode_number);
+int count_set_bits(char *map, int nbits);
 
 #endif
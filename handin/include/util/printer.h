@@ -1,6 +1,8 @@
 #ifndef _UTIL_PRINTER_H
 #define _UTIL_PRINTER_H
 
+#include <stdio.h>
+
 #include "ext2_fs.h"
 #include "disk.h"
 
@@ -20,7 +22,7 @@ int search_file(partition_t *pt, char *path, struct ext2_dir_entry_2 *ret);
 
 int print_part2(disk_t *disk);
 
-int print_child_dirs(partition_t *pt, int inode_id);
+int print_child_dirs(FILE *out, partition_t *pt, int inode_id);
 
 int print_block_content(char *buf);
 
@@ -0,0 +1,13 @@
+#ifndef _WRITEBACK_H
+#define _WRITEBACK_H
+
+#include <stdint.h>
+
+#include "backend.h"
+
+int writeback_start(const backend_t *io);
+int writeback_active(void);
+void writeback_submit(int64_t start_sector, unsigned int num_sectors, char *buf);
+int writeback_finish(void);
+
+#endif
@@ -0,0 +1,425 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "backend.h"
+
+// runs one preadv reads at most
+#define PREADV_MAX_RUNS 64
+// bytes the memory backend reads at a time while it loads the image
+#define MEMORY_LOAD_BYTES (1 << 20)
+
+extern const unsigned int sector_size_bytes;
+
+/* the data extents of a sparse image in sectors, [start, end) sorted by
+ * start. Without a map every sector counts as data. */
+typedef struct extent_s {
+        int64_t start;
+        int64_t end;
+} extent_t;
+
+static extent_t *extents = NULL;
+static int extent_count = 0;
+static int extent_map_loaded = 0;
+
+/* load_extent_map: find the data extents of a file with SEEK_DATA and
+ * SEEK_HOLE, so reads that fall in holes need no I/O.
+ *
+ * inputs:
+ *   int fd: the opened image.
+ *
+ * outputs:
+ *   the number of extents, -1 when the file system cannot tell.
+ */
+static int load_extent_map(int fd)
+{
+        int cap = 16;
+        off_t data = 0, hole;
+
+        free(extents);
+        extents = malloc(sizeof(extent_t) * cap);
+        extent_count = 0;
+        extent_map_loaded = 0;
+        if (!extents) {
+                return -1;
+        }
+
+        while ((data = lseek(fd, data, SEEK_DATA)) >= 0) {
+                if ((hole = lseek(fd, data, SEEK_HOLE)) < 0) {
+                        break;
+                }
+                if (extent_count == cap) {
+                        cap *= 2;
+                        extents = realloc(extents, sizeof(extent_t) * cap);
+                        if (!extents) {
+                                return -1;
+                        }
+                }
+                extents[extent_count].start = data / sector_size_bytes;
+                extents[extent_count].end = (hole + sector_size_bytes - 1) / sector_size_bytes;
+                extent_count++;
+                data = hole;
+        }
+        if (errno != ENXIO) {
+                /* no hole information, everything is data */
+                extent_count = 0;
+                return -1;
+        }
+
+        extent_map_loaded = 1;
+        return extent_count;
+}
+
+static void free_extent_map(void)
+{
+        free(extents);
+        extents = NULL;
+        extent_count = 0;
+        extent_map_loaded = 0;
+}
+
+/* sectors_in_hole: test if a range of sectors holds no data at all. */
+int sectors_in_hole(int64_t start_sector, unsigned int num_sectors)
+{
+        if (!__atomic_load_n(&extent_map_loaded, __ATOMIC_RELAXED)) {
+                return 0;
+        }
+
+        /* the first extent ending after the start */
+        int lo = 0, hi = extent_count;
+        while (lo < hi) {
+                int mid = (lo + hi) / 2;
+                if (extents[mid].end <= start_sector) {
+                        lo = mid + 1;
+                } else {
+                        hi = mid;
+                }
+        }
+        return lo == extent_count || extents[lo].start >= start_sector + num_sectors;
+}
+
+static int64_t file_sectors(int fd)
+{
+        // SEEK_END sizes block devices too, fstat does not
+        off_t end = lseek(fd, 0, SEEK_END);
+        if (end < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        return end / sector_size_bytes;
+}
+
+static void check_range(int64_t start_sector, unsigned int num_sectors, int64_t size, const char *what)
+{
+        if (start_sector < 0 || start_sector + num_sectors > size) {
+                fprintf(stderr, "%s sector %"PRId64" length %d failed: "
+                        "past the end of the image\n", what, start_sector, num_sectors);
+                exit(-1);
+        }
+}
+
+static void pwrite_all(int fd, int64_t start_sector, unsigned int num_sectors, const void *from)
+{
+        ssize_t ret;
+        ssize_t bytes_to_write = sector_size_bytes * num_sectors;
+
+        if ((ret = pwrite(fd, from, bytes_to_write, start_sector * sector_size_bytes)) != bytes_to_write) {
+                fprintf(stderr, "Write sector %"PRId64" length %d failed: "
+                        "returned %"PRId64"\n", start_sector, num_sectors, (int64_t)ret);
+                exit(-1);
+        }
+}
+
+// pread: positioned reads and writes on the file, holes read as zeroes
+
+static int pread_fd = -1;
+static int pread_written = 0;
+
+static int pread_open(int fd)
+{
+        pread_fd = fd;
+        pread_written = 0;
+        load_extent_map(fd);
+        return 0;
+}
+
+static void pread_read(int64_t start_sector, unsigned int num_sectors, void *into)
+{
+        ssize_t ret;
+        ssize_t bytes_to_read = sector_size_bytes * num_sectors;
+
+        if (sectors_in_hole(start_sector, num_sectors)) {
+                memset(into, 0, bytes_to_read);
+        } else if ((ret = pread(pread_fd, into, bytes_to_read, start_sector * sector_size_bytes)) != bytes_to_read) {
+                fprintf(stderr, "Read sector %"PRId64" length %d failed: "
+                        "returned %"PRId64"\n", start_sector, num_sectors, (int64_t)ret);
+                exit(-1);
+        }
+}
+
+// runs that follow each other on disk are read by one preadv
+static void pread_readv(sector_run_t *runs, int count)
+{
+        struct iovec iov[PREADV_MAX_RUNS];
+
+        for (int i = 0; i < count;) {
+                int64_t next = runs[i].start_sector;
+                ssize_t total = 0;
+                int n = 0;
+                while (i + n < count && n < PREADV_MAX_RUNS && runs[i + n].start_sector == next
+                       && !sectors_in_hole(runs[i + n].start_sector, runs[i + n].num_sectors)) {
+                        iov[n].iov_base = runs[i + n].buf;
+                        iov[n].iov_len = (size_t)runs[i + n].num_sectors * sector_size_bytes;
+                        next += runs[i + n].num_sectors;
+                        total += iov[n].iov_len;
+                        n++;
+                }
+                if (n <= 1) {
+                        pread_read(runs[i].start_sector, runs[i].num_sectors, runs[i].buf);
+                        i++;
+                        continue;
+                }
+                ssize_t ret = preadv(pread_fd, iov, n, runs[i].start_sector * sector_size_bytes);
+                if (ret != total) {
+                        fprintf(stderr, "Read sector %"PRId64" length %"PRId64" failed: "
+                                "returned %"PRId64"\n", runs[i].start_sector,
+                                next - runs[i].start_sector, (int64_t)ret);
+                        exit(-1);
+                }
+                i += n;
+        }
+}
+
+static void pread_write(int64_t start_sector, unsigned int num_sectors, const void *from)
+{
+        pwrite_all(pread_fd, start_sector, num_sectors, from);
+        pread_written = 1;
+        /* the range may have been a hole, the map no longer knows. The
+         * writeback thread writes while the checker reads. */
+        __atomic_store_n(&extent_map_loaded, 0, __ATOMIC_RELAXED);
+}
+
+static int pread_flush(void)
+{
+        if (pread_written && fdatasync(pread_fd) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        pread_written = 0;
+        return 0;
+}
+
+static int64_t pread_size(void)
+{
+        return file_sectors(pread_fd);
+}
+
+static void pread_hint(int64_t start_sector, int64_t num_sectors, int advice)
+{
+        int fadvice = advice == IO_HINT_WILLNEED ? POSIX_FADV_WILLNEED
+                : advice == IO_HINT_SEQUENTIAL ? POSIX_FADV_SEQUENTIAL : POSIX_FADV_DONTNEED;
+        posix_fadvise(pread_fd, start_sector * sector_size_bytes, num_sectors * sector_size_bytes, fadvice);
+}
+
+static void pread_close(void)
+{
+        free_extent_map();
+        pread_fd = -1;
+}
+
+const backend_t pread_backend = {
+        "pread", pread_open, pread_read, pread_readv, pread_write,
+        pread_flush, pread_size, pread_hint, pread_close
+};
+
+// mmap: the image mapped shared, reads and writes are copies
+
+static char *map = NULL;
+static size_t map_bytes = 0;
+static int map_written = 0;
+
+static int mmap_open(int fd)
+{
+        map_bytes = file_sectors(fd) * sector_size_bytes;
+        if (map_bytes == 0) {
+                return -1;
+        }
+        int writable = (fcntl(fd, F_GETFL) & O_ACCMODE) == O_RDWR;
+        map = mmap(NULL, map_bytes, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+                map = NULL;
+                return -1;
+        }
+        map_written = 0;
+        return 0;
+}
+
+static void mmap_read(int64_t start_sector, unsigned int num_sectors, void *into)
+{
+        check_range(start_sector, num_sectors, map_bytes / sector_size_bytes, "Read");
+        memcpy(into, map + start_sector * sector_size_bytes, (size_t)num_sectors * sector_size_bytes);
+}
+
+static void mmap_readv(sector_run_t *runs, int count)
+{
+        for (int i = 0; i < count; i++) {
+                mmap_read(runs[i].start_sector, runs[i].num_sectors, runs[i].buf);
+        }
+}
+
+static void mmap_write(int64_t start_sector, unsigned int num_sectors, const void *from)
+{
+        check_range(start_sector, num_sectors, map_bytes / sector_size_bytes, "Write");
+        memcpy(map + start_sector * sector_size_bytes, from, (size_t)num_sectors * sector_size_bytes);
+        map_written = 1;
+}
+
+static int mmap_flush(void)
+{
+        if (map_written && msync(map, map_bytes, MS_SYNC) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        map_written = 0;
+        return 0;
+}
+
+static int64_t mmap_size(void)
+{
+        return map_bytes / sector_size_bytes;
+}
+
+static void mmap_hint(int64_t start_sector, int64_t num_sectors, int advice)
+{
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t begin = start_sector * sector_size_bytes / page * page;
+        size_t end = (start_sector + num_sectors) * sector_size_bytes;
+        if (end > map_bytes) {
+                end = map_bytes;
+        }
+        if (begin >= end) {
+                return;
+        }
+        int madvice = advice == IO_HINT_WILLNEED ? MADV_WILLNEED
+                : advice == IO_HINT_SEQUENTIAL ? MADV_SEQUENTIAL : MADV_DONTNEED;
+        madvise(map + begin, end - begin, madvice);
+}
+
+static void mmap_close(void)
+{
+        if (map) {
+                munmap(map, map_bytes);
+        }
+        map = NULL;
+        map_bytes = 0;
+}
+
+const backend_t mmap_backend = {
+        "mmap", mmap_open, mmap_read, mmap_readv, mmap_write,
+        mmap_flush, mmap_size, mmap_hint, mmap_close
+};
+
+// memory: the whole image read in at open, writes go through to the file
+
+static char *image = NULL;
+static size_t image_bytes = 0;
+static int image_fd = -1;
+static int image_written = 0;
+
+static int memory_open(int fd)
+{
+        image_bytes = file_sectors(fd) * sector_size_bytes;
+        image = malloc(image_bytes ? image_bytes : 1);
+        if (!image) {
+                return -1;
+        }
+        image_fd = fd;
+        image_written = 0;
+
+        // holes are not read
+        load_extent_map(fd);
+        for (size_t offset = 0; offset < image_bytes; offset += MEMORY_LOAD_BYTES) {
+                size_t bytes = image_bytes - offset < MEMORY_LOAD_BYTES ? image_bytes - offset : MEMORY_LOAD_BYTES;
+                if (sectors_in_hole(offset / sector_size_bytes, bytes / sector_size_bytes)) {
+                        memset(image + offset, 0, bytes);
+                } else if (pread(fd, image + offset, bytes, offset) != bytes) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, "read image");
+                }
+        }
+
+        return 0;
+}
+
+static void memory_read(int64_t start_sector, unsigned int num_sectors, void *into)
+{
+        check_range(start_sector, num_sectors, image_bytes / sector_size_bytes, "Read");
+        memcpy(into, image + start_sector * sector_size_bytes, (size_t)num_sectors * sector_size_bytes);
+}
+
+static void memory_readv(sector_run_t *runs, int count)
+{
+        for (int i = 0; i < count; i++) {
+                memory_read(runs[i].start_sector, runs[i].num_sectors, runs[i].buf);
+        }
+}
+
+static void memory_write(int64_t start_sector, unsigned int num_sectors, const void *from)
+{
+        check_range(start_sector, num_sectors, image_bytes / sector_size_bytes, "Write");
+        memcpy(image + start_sector * sector_size_bytes, from, (size_t)num_sectors * sector_size_bytes);
+        pwrite_all(image_fd, start_sector, num_sectors, from);
+        image_written = 1;
+        __atomic_store_n(&extent_map_loaded, 0, __ATOMIC_RELAXED);
+}
+
+static int memory_flush(void)
+{
+        if (image_written && fdatasync(image_fd) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        image_written = 0;
+        return 0;
+}
+
+static int64_t memory_size(void)
+{
+        return image_bytes / sector_size_bytes;
+}
+
+static void memory_hint(int64_t start_sector, int64_t num_sectors, int advice)
+{
+        // everything is resident already
+}
+
+static void memory_close(void)
+{
+        free(image);
+        image = NULL;
+        image_bytes = 0;
+        image_fd = -1;
+        free_extent_map();
+}
+
+const backend_t memory_backend = {
+        "memory", memory_open, memory_read, memory_readv, memory_write,
+        memory_flush, memory_size, memory_hint, memory_close
+};
+
+// the backends that can be asked for by name
+static const backend_t *backends[] = {&pread_backend, &mmap_backend, &memory_backend};
+
+const backend_t *find_backend(const char *name)
+{
+        for (int i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+                if (strcmp(backends[i]->name, name) == 0) {
+                        return backends[i];
+                }
+        }
+        return NULL;
+}
@@ -1,36 +1,116 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <error.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "disk.h"
+#include "link_count.h"
 #include "link_list.h"
+#include "plan.h"
 #include "slice.h"
+#include "spill.h"
+#include "util/bitmap.h"
 #include "util/partition.h"
 #include "util/printer.h"
 
 #include "readwrite.h"
+#include "traverse.h"
 
-#define MAP_UNIT_SIZE 8
-#define SET_BIT(map, offset) ((map)[((offset)-1) / MAP_UNIT_SIZE] = (map)[((offset)-1) / MAP_UNIT_SIZE] | (0x1 << (((offset)-1) % MAP_UNIT_SIZE)))
-#define CLR_BIT(map, offset) ((map)[((offset)-1) / MAP_UNIT_SIZE] = (map)[((offset)-1) / MAP_UNIT_SIZE] & ~(0x1 << (((offset)-1) % MAP_UNIT_SIZE)))
-
-#define GET_BIT(map, offset) (((map)[((offset)-1) / MAP_UNIT_SIZE] >> (((offset)-1) % MAP_UNIT_SIZE)) & 0x1)
-
-static int *inode_book;
+static link_count_t *inode_book;
 static int book_size;
 
 static char *block_bmap;
 static int block_num;
 
+// (block, inode) pairs for every claimant of a block marked twice
+static slice_t *dup_owners;
+
+// directories reached by the running breadth_search()
+static char *visited_dirs;
+
+// (directory, parent) pairs whose '.' or '..' a worker found wrong, one
+// list per worker while a parallel search checks directories, repaired
+// once the search is over
+static slice_t **dir_repairs;
+static int root_broken;
+
+// serializes the repairs optimize_dir() makes from the search
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+
+extern const unsigned int sector_size_bytes;
 extern int pass;
+extern int jobs;
+extern int optimize_dirs;
 
-int breadth_search(list_t* queue, partition_t *pt,
-                   int (*func)(partition_t*, int))
+static inline int inode_bitmap_size(partition_t *pt)
+{
+        return pt->super_block->s_inodes_count / MAP_UNIT_SIZE + 1;
+}
+
+// bytes of a bitmap with a bit for every block the groups can hold
+static inline int block_bitmap_size(partition_t *pt)
+{
+        return get_block_size(pt) * pt->group_count;
+}
+
+static char *calloc_inode_bitmap(partition_t *pt)
+{
+        return spill_calloc(1, inode_bitmap_size(pt));
+}
+
+// order pairs of ints by the first, then by the second
+static int compare_pair(const void *a, const void *b)
+{
+        const int *x = a, *y = b;
+        return x[0] != y[0] ? x[0] - y[0] : x[1] - y[1];
+}
+
+// test if ancestor is found walking up the '..' entries from inode
+static int is_ancestor(partition_t *pt, int ancestor, int inode)
+{
+        for (int depth = 0; depth < pt->super_block->s_inodes_count; depth++) {
+                if (inode == ancestor) {
+                        return 1;
+                }
+                if (inode == EXT2_ROOT_INO || !is_valid_inode(pt, inode)) {
+                        return 0;
+                }
+                inode = get_parent_inode(pt, inode);
+        }
+        return 0;
+}
+
+// a directory reached twice is either linked from two parents or is an
+// ancestor of the directory that links it
+static void report_dir_link(partition_t *pt, int parent, int child)
+{
+        if (pass != 1) {
+                return;
+        }
+        if (is_ancestor(pt, child, parent)) {
+                printf("Directory inode %d linked from inode %d forms a cycle\n", child, parent);
+        } else {
+                printf("Directory inode %d has another link from inode %d\n", child, parent);
+        }
+}
+
+// breadth first search, a directory is never enqueued twice and the
+// caller marks the inodes already in the queue as visited. With more than
+// one job the work-stealing search runs instead, so func must be safe to
+// call from several threads.
+int breadth_search_marked(list_t* queue, partition_t *pt,
+                          int (*func)(partition_t*, int), char *visited)
 {
         int inode_id;
 
+        if (jobs > 1) {
+                return parallel_search(queue, pt, func, report_dir_link, visited, jobs);
+        }
+
         while (queue->len > 0) {
                 // pop
                 ll_pop(queue, &inode_id);
@@ -39,7 +119,9 @@ int breadth_search(list_t* queue, partition_t *pt,
                 if (!is_valid_inode(pt, inode_id)) {
                         continue;
                 }
-                func(pt, inode_id);
+                if (func) {
+                        func(pt, inode_id);
+                }
 
                 // get child list
                 slice_t *children = get_child_inodes(pt, inode_id);
@@ -48,9 +130,18 @@ int breadth_search(list_t* queue, partition_t *pt,
                 int c_id;
                 for (int i = 2; i < children->len; i++) {
                         get(children, i, &c_id);
-                        if (is_dir(pt, c_id)) {
-                                ll_append(queue, &c_id);
+                        if (!is_valid_inode(pt, c_id)) {
+                                continue;
+                        }
+                        if (!is_dir(pt, c_id)) {
+                                continue;
+                        }
+                        if (GET_BIT(visited, c_id)) {
+                                report_dir_link(pt, inode_id, c_id);
+                                continue;
                         }
+                        SET_BIT(visited, c_id);
+                        ll_append(queue, &c_id);
                 }
                 delete_slice(children);
         }
@@ -58,14 +149,48 @@ int breadth_search(list_t* queue, partition_t *pt,
         return 0;
 }
 
+int breadth_search(list_t* queue, partition_t *pt,
+                   int (*func)(partition_t*, int))
+{
+        int inode_id;
+        char *visited = calloc_inode_bitmap(pt);
+
+        for (node_t *node = queue->head->next; node != queue->tail; node = node->next) {
+                inode_id = *(int *)node->item;
+                if (is_valid_inode(pt, inode_id)) {
+                        SET_BIT(visited, inode_id);
+                }
+        }
+
+        visited_dirs = visited;
+        breadth_search_marked(queue, pt, func, visited);
+        visited_dirs = NULL;
+
+        spill_free(visited, inode_bitmap_size(pt));
+        return 0;
+}
+
+// the listing is built aside and printed by one call, which stdio keeps
+// whole when several workers print
 int print_dir(partition_t *pt, int inode_id)
 {
-        printf("inode %d\n", inode_id);
+        char *buf;
+        size_t len;
+        FILE *out = open_memstream(&buf, &len);
+        if (!out) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        fprintf(out, "inode %d\n", inode_id);
         if (inode_id == 0) {
-                printf("\n");
-                return 0;
+                fprintf(out, "\n");
+        } else {
+                print_child_dirs(out, pt, inode_id);
         }
-        print_child_dirs(pt, inode_id);
+        fclose(out);
+
+        fwrite(buf, 1, len, stdout);
+        free(buf);
 
         return 0;
 }
@@ -97,40 +222,149 @@ static int modify_dir(struct ext2_dir_entry_2 *dir, int inode_id, char *name, in
         return 0;
 }
 
-// assume that we can fit into one block
+static inline int same_entry(struct ext2_dir_entry_2 *a, struct ext2_dir_entry_2 *b)
+{
+        return a->inode == b->inode && a->name_len == b->name_len
+                && a->file_type == b->file_type && memcmp(a->name, b->name, a->name_len) == 0;
+}
+
+// the old entries searched for one of the new list before it counts as new
+#define WRITE_DIRS_LOOKAHEAD 256
+
+// rewrite a directory from list across the blocks it already has. An entry
+// stays in the block it was read from unless earlier ones push it on, new
+// entries go where the previous one went. Entries get the minimal rec_len,
+// the last one of a block takes the rest of it, and only blocks whose
+// entries changed are written. Returns -1, writing nothing, when they do
+// not fit.
 int write_dirs(partition_t *pt, int inode_id, list_t *list)
 {
         int block_size = get_block_size(pt);
-
-        char *block_buf = calloc(1, block_size*2);
-        if (!block_buf) {
+        slice_t *blocks = get_blocks(pt, inode_id);
+        int block_count = blocks->len;
+        int ret = 0;
+
+        slice_t **old = malloc(sizeof(slice_t *) * block_count);
+        slice_t **placed = malloc(sizeof(slice_t *) * block_count);
+        int *used = calloc(block_count, sizeof(int));
+        if ((!old || !placed || !used) && block_count > 0) {
                 error_at_line(-1, errno, __FILE__, __LINE__, NULL);
         }
 
-        int offset = 0;
-        int len = list->len;
-        struct ext2_dir_entry_2 dir;
-        for (int i = 0; i < len-1; i++) {
-                ll_pop(list, &dir);
-                memcpy(block_buf+offset, &dir, dir.rec_len);
-                offset += dir.rec_len;
+        for (int b = 0; b < block_count; b++) {
+                int block_id;
+                get(blocks, b, &block_id);
+                char *block = read_block(pt, block_id, 1);
+                old[b] = make_slice(64, sizeof(struct ext2_dir_entry_2));
+                get_block_dirs(pt, block, old[b]);
+                placed[b] = make_slice(64, sizeof(struct ext2_dir_entry_2));
+                free(block);
         }
 
-        ll_pop(list, &dir);
-        if ((dir.name_len+8+3)/4*4 + offset > block_size) {
-                printf("WARNING: more than one block\n");
-                return 0;
+        // the old entry following the last one matched
+        int old_block = 0, old_index = 0;
+        int cur = 0;
+        struct ext2_dir_entry_2 dir, old_dir;
+        while (list->len > 0) {
+                ll_pop(list, &dir);
+
+                int origin = -1;
+                int b = old_block, i = old_index;
+                for (int n = 0; b < block_count && n < WRITE_DIRS_LOOKAHEAD; n++) {
+                        if (i >= old[b]->len) {
+                                b++;
+                                i = 0;
+                                continue;
+                        }
+                        get(old[b], i, &old_dir);
+                        if (same_entry(&dir, &old_dir)) {
+                                origin = b;
+                                old_block = b;
+                                old_index = i + 1;
+                                break;
+                        }
+                        i++;
+                }
+
+                int rec_len = compute_rec_len(&dir);
+                int target = origin > cur ? origin : cur;
+                while (target < block_count && used[target] + rec_len > block_size) {
+                        target++;
+                }
+                if (target == block_count) {
+                        printf("WARNING: directory inode %d is full\n", inode_id);
+                        ret = -1;
+                        break;
+                }
+
+                dir.rec_len = rec_len;
+                append(placed[target], &dir);
+                used[target] += rec_len;
+                cur = target;
         }
-        dir.rec_len = block_size - offset;
-        memcpy(block_buf+offset, &dir, dir.rec_len);
 
-        struct ext2_inode *entry = get_inode_entry(pt, inode_id);
-        int block_number = entry->i_block[0];
+        int written = 0;
+        char *block_buf = malloc(block_size);
+        if (!block_buf) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        for (int b = 0; b < block_count && ret == 0; b++) {
+                int changed = placed[b]->len != old[b]->len;
+                for (int i = 0; i < placed[b]->len && !changed; i++) {
+                        get(placed[b], i, &dir);
+                        get(old[b], i, &old_dir);
+                        changed = !same_entry(&dir, &old_dir);
+                }
+                if (!changed) {
+                        continue;
+                }
 
-        write_block(pt, block_number, 1, block_buf);
+                memset(block_buf, 0, block_size);
+                int offset = 0;
+                for (int i = 0; i < placed[b]->len; i++) {
+                        get(placed[b], i, &dir);
+                        if (i == placed[b]->len - 1) {
+                                dir.rec_len = block_size - offset;
+                        }
+                        memcpy(block_buf+offset, &dir, 8 + dir.name_len);
+                        offset += dir.rec_len;
+                }
+                if (placed[b]->len == 0) {
+                        // an empty block is one unused entry spanning it
+                        memset(&dir, 0, sizeof(dir));
+                        dir.rec_len = block_size;
+                        memcpy(block_buf, &dir, 8);
+                }
 
+                int block_id;
+                get(blocks, b, &block_id);
+                write_block(pt, block_id, 1, block_buf);
+                written = 1;
+        }
         free(block_buf);
-        return 0;
+
+        if (written) {
+                dcache_invalidate(pt->dcache, inode_id);
+
+                // the hash index no longer matches the leaves, the directory
+                // is read linearly until it is indexed again
+                struct ext2_inode *entry = get_inode_entry(pt, inode_id);
+                if (entry->i_flags & EXT2_INDEX_FL) {
+                        entry->i_flags &= ~EXT2_INDEX_FL;
+                        mark_inode_dirty(pt, inode_id);
+                }
+        }
+
+        for (int b = 0; b < block_count; b++) {
+                delete_slice(old[b]);
+                delete_slice(placed[b]);
+        }
+        free(old);
+        free(placed);
+        free(used);
+        delete_slice(blocks);
+
+        return ret;
 }
 
 static int delete_other_parent(partition_t *pt, int child_inode, int parent_inode)
@@ -220,77 +454,112 @@ int check_self_parent(partition_t *pt, int self_inode, int parent_inode)
         return 0;
 }
 
-static int change_parent_inode(partition_t *pt, int inode, int parent_inode)
+// the root is its own parent, its '.' and '..' are only checked by name
+static int root_ok(slice_t *s)
 {
-        struct ext2_dir_entry_2 dir;
-        memset(&dir, 0, sizeof(struct ext2_dir_entry_2));
+        struct ext2_dir_entry_2 self_dir;
+        struct ext2_dir_entry_2 parent_dir;
 
-        if (!is_valid_inode(pt, inode) || !is_dir(pt, inode)) {
-                return -1;
+        if (s->len < 2) {
+                return 0;
         }
-
-        struct ext2_inode *entry = get_inode_entry(pt, inode);
-
-        char *block = read_block(pt, entry->i_block[0], 1);
-
-        memcpy(&dir, block+12, sizeof(struct ext2_dir_entry_2));
-        dir.inode = parent_inode;
-
-        memcpy(block+12, &dir, dir.rec_len); // hard code the offset
-        write_block(pt, entry->i_block[0], 1, block);
-        free(block);
-
-        return 0;
+        get(s, 0, &self_dir);
+        get(s, 1, &parent_dir);
+        return strncmp(parent_dir.name, "..", 2) == 0 && strncmp(self_dir.name, ".", 1) == 0;
 }
 
-int check_dir(partition_t *pt, int inode_id)
+static void check_root(partition_t *pt)
 {
-        struct ext2_dir_entry_2 dir;
         struct ext2_dir_entry_2 self_dir;
         struct ext2_dir_entry_2 parent_dir;
+        int need_write_back = 0;
 
-        slice_t *s = get_child_dirs(pt, inode_id);
+        slice_t *s = get_child_dirs(pt, 2);
         list_t *list = slice_to_list(s);
 
-        if (inode_id == 2) { // root
-                int need_write_back = 0;
+        ll_pop(list, &self_dir);
+        ll_pop(list, &parent_dir);
 
-                ll_pop(list, &self_dir);
-                ll_pop(list, &parent_dir);
+        if (strncmp(parent_dir.name, "..", 2) != 0) {
+                need_write_back = 1;
+                if (pass == 1) {
+                        printf("root parent ptr error\n");
+                }
 
-                if (strncmp(parent_dir.name, "..", 2) != 0) {
-                        need_write_back = 1;
-                        if (pass == 1) {
-                                printf("root parent ptr error\n");
-                        }
+                ll_push(list, &parent_dir);
+                modify_dir(&parent_dir, 2, "..", 2);
+        }
 
-                        ll_push(list, &parent_dir);
-                        modify_dir(&parent_dir, 2, "..", 2);
+        if (strncmp(self_dir.name, ".", 1) != 0) {
+                need_write_back = 1;
+                if (pass == 1) {
+                        printf("root self ptr error\n");
                 }
 
-                if (strncmp(self_dir.name, ".", 1) != 0) {
-                        need_write_back = 1;
-                        if (pass == 1) {
-                                printf("root self ptr error\n");
-                        }
+                ll_push(list, &self_dir);
+                modify_dir(&self_dir, 1, ".", 1);
+        }
 
-                        ll_push(list, &self_dir);
-                        modify_dir(&self_dir, 1, ".", 1);
+        if (need_write_back) {
+                write_dirs(pt, 2, list);
+                if (pass == 1) {
+                        printf("fixed\n");
                 }
+        }
 
-                if (need_write_back) {
-                        write_dirs(pt, 2, list);
-                        if (pass == 1) {
-                                printf("fixed\n");
-                        }
+        ll_delete_list(list);
+        delete_slice(s);
+}
+
+// test the '.' and '..' entries check_self_parent() would rewrite
+static int self_parent_ok(partition_t *pt, int self_inode, int parent_inode)
+{
+        struct ext2_dir_entry_2 self_dir;
+        struct ext2_dir_entry_2 parent_dir;
+
+        slice_t *s = get_child_dirs(pt, self_inode);
+        int ok = s->len >= 2;
+        if (ok) {
+                get(s, 0, &self_dir);
+                get(s, 1, &parent_dir);
+                ok = self_dir.inode == self_inode && parent_dir.inode == parent_inode;
+        }
+        delete_slice(s);
+
+        return ok;
+}
+
+// the repairs write other directories than the one being checked, so a
+// worker only records them and they are made after the search
+int check_dir(partition_t *pt, int inode_id)
+{
+        struct ext2_dir_entry_2 dir;
+
+        slice_t *s = get_child_dirs(pt, inode_id);
+
+        if (inode_id == 2 && !root_ok(s)) { // root
+                if (dir_repairs) {
+                        __atomic_store_n(&root_broken, 1, __ATOMIC_RELAXED);
+                } else {
+                        check_root(pt);
                 }
         }
 
-        get(s, 0, &dir);
-        int parent_inode = dir.inode;
+        // not the '.' entry, which may be wrong until the repairs are made
+        int parent_inode = inode_id;
         for (int i = 2; i < s->len; i++) {
                 get(s, i, &dir);
-                if (is_dir(pt, dir.inode)) {
+                if (visited_dirs && is_valid_inode(pt, dir.inode) && test_bit(visited_dirs, dir.inode)) {
+                        // another link to a reached directory, reported by the search
+                        continue;
+                }
+                if (!is_dir(pt, dir.inode) || self_parent_ok(pt, dir.inode, parent_inode)) {
+                        continue;
+                }
+                if (dir_repairs) {
+                        int pair[2] = {dir.inode, parent_inode};
+                        append(dir_repairs[traverse_worker_id()], pair);
+                } else {
                         check_self_parent(pt, dir.inode, parent_inode);
                 }
         }
@@ -299,6 +568,39 @@ int check_dir(partition_t *pt, int inode_id)
         return 0;
 }
 
+// make the repairs recorded by the workers in inode order. A directory
+// two parents link may be recorded by both, the first one wins as the
+// serial search would only check it from one.
+static void apply_dir_repairs(partition_t *pt)
+{
+        slice_t *all = make_slice(64, sizeof(int) * 2);
+        int pair[2];
+        for (int w = 0; w < jobs; w++) {
+                for (int i = 0; i < dir_repairs[w]->len; i++) {
+                        get(dir_repairs[w], i, pair);
+                        append(all, pair);
+                }
+                delete_slice(dir_repairs[w]);
+        }
+        free(dir_repairs);
+        dir_repairs = NULL;
+
+        if (root_broken) {
+                check_root(pt);
+                root_broken = 0;
+        }
+
+        qsort(all->array, all->len, sizeof(int) * 2, compare_pair);
+        int *items = (int *)all->array;
+        for (int i = 0; i < all->len; i++) {
+                if (i > 0 && items[i*2] == items[(i-1)*2]) {
+                        continue;
+                }
+                check_self_parent(pt, items[i*2], items[i*2+1]);
+        }
+        delete_slice(all);
+}
+
 void check_dir_ptrs(partition_t *pt)
 {
         if (pass == 1) {
@@ -310,19 +612,132 @@ void check_dir_ptrs(partition_t *pt)
         int root_inode = 2;
         ll_append(queue, &root_inode); // enqueue the root;
 
+        if (jobs > 1) {
+                dir_repairs = malloc(sizeof(slice_t *) * jobs);
+                if (!dir_repairs) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                for (int w = 0; w < jobs; w++) {
+                        dir_repairs[w] = make_slice(16, sizeof(int) * 2);
+                }
+        }
+
         breadth_search(queue, pt, check_dir);
 
+        if (dir_repairs) {
+                apply_dir_repairs(pt);
+        }
+
         ll_delete_list(queue);
 }
 
 int calloc_inode_book(partition_t *pt)
 {
+        int inodes_per_group = get_inodes_per_group(pt);
+
         book_size = pt->super_block->s_inodes_count + 1;
-        inode_book = calloc(1, sizeof(int) * book_size);
-        if (!inode_book) {
+        inode_book = lc_new(pt->group_count, inodes_per_group);
+
+        // only groups with inodes in use are walked when fixing counts
+        for (int i = 0; i < pt->group_count; i++) {
+                if (count_set_bits(pt->groups[i]->inode_bitmap, inodes_per_group) > 0) {
+                        lc_set_in_use(inode_book, i);
+                }
+        }
+
+        return 0;
+}
+
+// inodes counted by one chunk of a shard
+#define SHARD_CHUNK 1024
+
+// reference counts gathered by one worker, in chunks allocated on first
+// touch so a worker only pays for the inode ranges it reaches
+typedef struct count_shard_s {
+        int **chunks;
+} count_shard_t;
+
+// one shard per worker while a parallel search counts references
+static count_shard_t *shards;
+static int shard_chunks;
+
+static inline void count_ref(int inode_id)
+{
+        if (!shards) {
+                lc_add(inode_book, inode_id, 1);
+                return;
+        }
+
+        int **chunk = &shards[traverse_worker_id()].chunks[inode_id / SHARD_CHUNK];
+        if (!*chunk) {
+                *chunk = calloc(SHARD_CHUNK, sizeof(int));
+                if (!*chunk) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+        }
+        (*chunk)[inode_id % SHARD_CHUNK]++;
+}
+
+static void alloc_shards(void)
+{
+        shard_chunks = (book_size + SHARD_CHUNK - 1) / SHARD_CHUNK;
+        shards = calloc(jobs, sizeof(count_shard_t));
+        if (!shards) {
                 error_at_line(-1, errno, __FILE__, __LINE__, NULL);
         }
+        for (int i = 0; i < jobs; i++) {
+                shards[i].chunks = calloc(shard_chunks, sizeof(int *));
+                if (!shards[i].chunks) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+        }
+}
+
+// add every shard into inode_book and drop the shards
+static void merge_shards(void)
+{
+        for (int c = 0; c < shard_chunks; c++) {
+                int start = c * SHARD_CHUNK;
+                int end = start + SHARD_CHUNK < book_size ? start + SHARD_CHUNK : book_size;
+                for (int i = 0; i < jobs; i++) {
+                        int *chunk = shards[i].chunks[c];
+                        if (!chunk) {
+                                continue;
+                        }
+                        for (int k = start; k < end; k++) {
+                                if (chunk[k - start]) {
+                                        lc_add(inode_book, k, chunk[k - start]);
+                                }
+                        }
+                        free(chunk);
+                }
+        }
+
+        for (int i = 0; i < jobs; i++) {
+                free(shards[i].chunks);
+        }
+        free(shards);
+        shards = NULL;
+}
+
+// run a search whose callback counts references, with more than one job
+// every worker counts into its own shard and the shards are reduced after
+static int count_search(list_t *queue, partition_t *pt,
+                        int (*func)(partition_t*, int), char *visited)
+{
+        if (jobs > 1) {
+                alloc_shards();
+        }
 
+        if (visited) {
+                breadth_search_marked(queue, pt, func, visited);
+        } else {
+                breadth_search(queue, pt, func);
+        }
+
+        if (shards) {
+                merge_shards();
+        }
         return 0;
 }
 
@@ -335,7 +750,7 @@ int mark_child_inodes_in_book(partition_t *pt, int inode)
                 if (!is_valid_inode(pt, inode_id)) {
                         continue;
                 }
-                inode_book[inode_id]++;
+                count_ref(inode_id);
         }
         delete_slice(s);
         return 0;
@@ -350,61 +765,12 @@ int mark_only_child_inodes_in_book(partition_t *pt, int inode)
                 if (!is_valid_inode(pt, inode_id)) {
                         continue;
                 }
-                inode_book[inode_id]++;
+                count_ref(inode_id);
         }
         delete_slice(s);
         return 0;
 }
 
-static char ** allocate_inode_block(partition_t *pt) {
-        int inodes_per_block = get_block_size(pt) / sizeof(struct ext2_inode);
-        int inodes_per_group = get_inodes_per_group(pt);
-        int blocks_of_inodes_per_group = (inodes_per_group + (inodes_per_block - 1)) / inodes_per_block;
-        int total_blocks = blocks_of_inodes_per_group * pt->group_count;
-
-        char ** block_group = malloc(sizeof(char *) * total_blocks);
-        if (!block_group) {
-                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
-        }
-
-        for (int i = 0; i < pt->group_count; i++) {
-                int table_id_started = get_inode_table_bid(pt->groups[i]);
-                for (int j = 0; j < blocks_of_inodes_per_group; j++) {
-                        block_group[i*blocks_of_inodes_per_group+j] = read_block(pt, table_id_started+j, 1);
-                }
-        }
-
-        return block_group;
-}
-
-static int index_to_bid(partition_t *pt, int index)
-{
-        int inodes_per_block = get_block_size(pt) / sizeof(struct ext2_inode);
-        int inodes_per_group = get_inodes_per_group(pt);
-        int blocks_of_inodes_per_group = (inodes_per_group + (inodes_per_block - 1)) / inodes_per_block;
-
-        int group_number = index / blocks_of_inodes_per_group;
-        int block_offset = index % blocks_of_inodes_per_group;
-
-        int block_start = get_inode_table_bid(pt->groups[group_number]);
-
-        return block_start + block_offset;
-}
-
-static int modify_inode_block_array(partition_t *pt, char **block_array,
-                                    int *dirty_array, int inode_id, struct ext2_inode *entry)
-{
-        int inode_entry_per_block = get_block_size(pt) / sizeof(struct ext2_inode);
-
-        int block_index = (inode_id - 1) / inode_entry_per_block;
-        int offset_in_block = (inode_id - 1) % inode_entry_per_block * sizeof(struct ext2_inode);
-
-        memcpy(block_array[block_index]+offset_in_block, entry, sizeof(struct ext2_inode));
-        dirty_array[block_index] = 1;
-
-        return 0;
-}
-
 static inline int get_file_type(int imode)
 {
         if ((imode & EXT2_S_IFSOCK) == EXT2_S_IFSOCK) {
@@ -444,107 +810,585 @@ static int create_lost_dir(partition_t *pt, struct ext2_dir_entry_2 *lost_dir, i
         return 0;
 }
 
-int breadth_mark(partition_t *pt, int inode)
+// an inode in use that no directory reachable from root refers to
+static inline int is_unreferenced(partition_t *pt, int inode)
 {
-        list_t *queue = ll_new_list(sizeof(int));
-
-        ll_append(queue, &inode); // enqueue the node
-
-        breadth_search(queue, pt, mark_only_child_inodes_in_book);
-
-        ll_delete_list(queue);
-        return 0;
+        return get_inode_entry(pt, inode)->i_links_count > 0 && lc_get(inode_book, inode) == 0;
 }
 
-static int fix_idle_inodes(partition_t *pt)
+static void mark_reserved_blocks(char *bmap)
 {
-        int add_lost_found = 0;
+        // hack
+        for (int i = 0; i < 100; i++) {
+                SET_BIT(bmap, i);
+        }
+}
 
-        struct ext2_dir_entry_2 lost_dir;
-        int lost_found_inode = get_lost_found_inode(pt);
-        slice_t *lost_found = get_child_dirs(pt, lost_found_inode);
-        int old_last_dir_index = lost_found->len - 1;
+// inodes handed to a marking worker at a time
+#define SCAN_CHUNK 256
+
+// state of one worker marking blocks, duplicates are kept per worker and
+// merged after the workers join
+typedef struct scan_worker_s {
+        partition_t *pt;
+        int *next_chunk;
+        int chunk_count;
+        char *bmap;
+        int block_count;
+        int find_dups;
+        slice_t *dup_owners;
+} scan_worker_t;
+
+// the blocks an in-use inode owns, including its indirect blocks, NULL
+// when it owns none
+static slice_t *owned_block_list(partition_t *pt, int inode_id)
+{
+        struct ext2_inode *entry = get_inode_entry(pt, inode_id);
+
+        if (entry->i_links_count == 0) {
+                return NULL;
+        }
+        if (is_symbol(pt, inode_id) && entry->i_blocks == 0) {
+                // fast symbolic link, the path lives in i_block
+                return NULL;
+        }
+        return get_allocated_blocks(pt, inode_id);
+}
+
+// mark every block owned by one in-use inode
+static int mark_inode_blocks(scan_worker_t *w, int inode_id)
+{
+        int block_id;
+        slice_t *blocks = owned_block_list(w->pt, inode_id);
 
-        // start from root to mark children of idle nodes
-        for (int i = 2; i < book_size; i++) {
-                struct ext2_inode *entry = get_inode_entry(pt, i);
-                if (entry->i_links_count > 0 && inode_book[i] == 0) {
-                        // try to mark its child
-                        breadth_mark(pt, i);
+        if (!blocks) {
+                return 0;
+        }
+        for (int j = 0; j < blocks->len; j++) {
+                get(blocks, j, &block_id);
+                if (block_id <= 0 || block_id > w->block_count) {
+                        continue;
+                }
+                // a block found marked is a duplicate, the inode that
+                // marked it first is looked for once the scan is over
+                if (test_and_set_bit(w->bmap, block_id) && w->find_dups) {
+                        int pair[2] = {block_id, inode_id};
+                        append(w->dup_owners, pair);
                 }
         }
+        delete_slice(blocks);
+
+        return 0;
+}
+
+// claim chunks of the inode tables until none is left, each chunk is
+// walked in on-disk order guided by the inode bitmap
+static void *scan_worker(void *arg)
+{
+        scan_worker_t *w = arg;
+        int inodes_per_group = get_inodes_per_group(w->pt);
+        int chunks_per_group = (inodes_per_group + SCAN_CHUNK - 1) / SCAN_CHUNK;
+
+        for (;;) {
+                int chunk = __atomic_fetch_add(w->next_chunk, 1, __ATOMIC_RELAXED);
+                if (chunk >= w->chunk_count) {
+                        break;
+                }
 
-        // start from root
-        for (int i = 2; i < book_size; i++) {
-                struct ext2_inode *entry = get_inode_entry(pt, i);
+                int g = chunk / chunks_per_group;
+                int start = chunk % chunks_per_group * SCAN_CHUNK;
+                int end = start + SCAN_CHUNK < inodes_per_group ? start + SCAN_CHUNK : inodes_per_group;
+                char *inode_bitmap = w->pt->groups[g]->inode_bitmap;
 
-                if (entry->i_links_count > 0 && inode_book[i] == 0) {
-                        // lost and found
-                        printf("Unconnected directory inode %d\n", i);
-                        create_lost_dir(pt, &lost_dir, i);
-                        if (is_dir(pt, i)) {
-                                change_parent_inode(pt, i, get_lost_found_inode(pt));
+                for (int i = start; i < end; i++) {
+                        if (i % MAP_UNIT_SIZE == 0 && inode_bitmap[i / MAP_UNIT_SIZE] == 0) {
+                                i += MAP_UNIT_SIZE - 1; // skip a whole free byte
+                                continue;
                         }
-                        append(lost_found, &lost_dir);
-                        add_lost_found = 1;
+                        if (!GET_BIT(inode_bitmap, i+1)) {
+                                continue;
+                        }
+                        mark_inode_blocks(w, g * inodes_per_group + i + 1);
                 }
         }
 
-        if (add_lost_found) {
-                // modify the rec_len of the last dir
-                struct ext2_dir_entry_2 old_last;
-                get(lost_found, old_last_dir_index, &old_last);
-                old_last.rec_len = compute_rec_len(&old_last);
-                set(lost_found, old_last_dir_index, &old_last);
+        return NULL;
+}
+
+// walk each group's inode table so every in-use inode's block map is
+// visited exactly once, split across jobs workers marking bmap. With
+// dups, (block, inode) pairs for every inode that found one of its blocks
+// marked already go there.
+static int scan_inode_tables(partition_t *pt, char *bmap, slice_t *dups)
+{
+        int next_chunk = 0;
+        int chunks_per_group = (get_inodes_per_group(pt) + SCAN_CHUNK - 1) / SCAN_CHUNK;
+
+        scan_worker_t *workers = calloc(jobs, sizeof(scan_worker_t));
+        pthread_t *threads = calloc(jobs, sizeof(pthread_t));
+        if (!workers || !threads) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
 
-                list_t *list = slice_to_list(lost_found);
-                write_dirs(pt, lost_found_inode, list);
-                ll_delete_list(list);
+        for (int i = 0; i < jobs; i++) {
+                workers[i].pt = pt;
+                workers[i].next_chunk = &next_chunk;
+                workers[i].chunk_count = chunks_per_group * pt->group_count;
+                workers[i].bmap = bmap;
+                workers[i].block_count = block_bitmap_size(pt) * MAP_UNIT_SIZE;
+                workers[i].find_dups = dups != NULL;
+                workers[i].dup_owners = make_slice(16, sizeof(int) * 2);
         }
 
-        free(lost_found);
-        return add_lost_found;
+        // the calling thread is the first worker
+        for (int i = 1; i < jobs; i++) {
+                int err = pthread_create(&threads[i], NULL, scan_worker, &workers[i]);
+                if (err) {
+                        error_at_line(-1, err, __FILE__, __LINE__, NULL);
+                }
+        }
+        scan_worker(&workers[0]);
+
+        for (int i = 0; i < jobs; i++) {
+                int pair[2];
+                if (i > 0) {
+                        pthread_join(threads[i], NULL);
+                }
+                for (int j = 0; j < workers[i].dup_owners->len; j++) {
+                        get(workers[i].dup_owners, j, pair);
+                        append(dups, pair);
+                }
+                delete_slice(workers[i].dup_owners);
+        }
+
+        free(threads);
+        free(workers);
+        return 0;
 }
 
-static int fix_inodes_count(partition_t *pt)
+static int is_pre_allocated(partition_t *pt, int id)
 {
-        int inodes_per_block = get_block_size(pt) / sizeof(struct ext2_inode);
-        int inodes_per_group = get_inodes_per_group(pt);
-        int blocks_of_inodes_per_group = (inodes_per_group + (inodes_per_block - 1)) / inodes_per_block;
-        int total_blocks = blocks_of_inodes_per_group * pt->group_count;
+        int inodes_size = get_inodes_per_group(pt) *  sizeof(struct ext2_inode);
+        int inodes_blocks = (inodes_size + get_block_size(pt) - 1) / get_block_size(pt);
+
+        for (int i = 0; i < pt->group_count; i++) {
+                int start = i * get_blocks_per_group(pt);
+                int inodes_table_start = get_inode_table_bid(pt->groups[i]);
+                int end = inodes_table_start + inodes_blocks;
+                if (id >= start && id < end) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+// write the block bitmap sectors changed by claim_block() and
+// release_block(), then the descriptors and the superblock whose free
+// counts follow them
+static void write_dirty_bitmaps(partition_t *pt)
+{
+        if (flush_block_bitmaps(pt) > 0) {
+                write_group_desc_table(pt);
+                write_super_block(pt);
+        }
+}
+
+// blocks owned by some in-use inode, scanned once before lost+found grows,
+// the bitmap on disk is not repaired until pass 4
+static char *owned_blocks;
+static int next_free_block;
+
+static void scan_owned_blocks(partition_t *pt)
+{
+        if (owned_blocks) {
+                return;
+        }
+        owned_blocks = spill_calloc(1, block_bitmap_size(pt));
+        scan_inode_tables(pt, owned_blocks, NULL);
+        mark_reserved_blocks(owned_blocks);
+        next_free_block = 1;
+}
+
+// claim a block free both in the bitmap and in the scan of the inode
+// tables, 0 when there is none left
+static int alloc_dir_block(partition_t *pt)
+{
+        for (; next_free_block < pt->super_block->s_blocks_count; next_free_block++) {
+                int block_id = next_free_block;
+                if (GET_BIT(owned_blocks, block_id) || block_allocated(pt, block_id)
+                    || is_pre_allocated(pt, block_id)) {
+                        continue;
+                }
+                SET_BIT(owned_blocks, block_id);
+                claim_block(pt, block_id);
+                next_free_block++;
+                return block_id;
+        }
+        return 0;
+}
+
+// claim a block and clear it on disk, for a new indirect block
+static int alloc_zeroed_block(partition_t *pt)
+{
+        int block_id = alloc_dir_block(pt);
+        if (block_id != 0) {
+                char *block = calloc(1, get_block_size(pt));
+                if (!block) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                write_block(pt, block_id, 1, block);
+                free(block);
+        }
+        return block_id;
+}
+
+// point the index-th block of a directory at block_id, allocating the
+// indirect blocks on the way and counting them in meta. Returns -1 past
+// the double indirect blocks or when the partition is full.
+static int map_dir_block(partition_t *pt, struct ext2_inode *entry, int index, int block_id, int *meta)
+{
+        int entries_per_block = get_block_size(pt) / 4; // 32-bit int
+        int depth;
+        __u32 *root;
+
+        if (index < EXT2_NDIR_BLOCKS) {
+                entry->i_block[index] = block_id;
+                return 0;
+        }
+        index -= EXT2_NDIR_BLOCKS;
+        if (index < entries_per_block) {
+                root = &entry->i_block[EXT2_IND_BLOCK];
+                depth = 1;
+        } else if ((index -= entries_per_block) < entries_per_block * entries_per_block) {
+                root = &entry->i_block[EXT2_DIND_BLOCK];
+                depth = 2;
+        } else {
+                return -1;
+        }
+
+        if (*root == 0) {
+                if ((*root = alloc_zeroed_block(pt)) == 0) {
+                        return -1;
+                }
+                (*meta)++;
+        }
+
+        int parent = *root;
+        for (; depth > 0; depth--) {
+                int span = depth == 2 ? entries_per_block : 1;
+                int *block = (int *)read_block(pt, parent, 1);
+                int slot = index / span;
+                index %= span;
+
+                if (depth == 1) {
+                        block[slot] = block_id;
+                } else if (block[slot] == 0) {
+                        if ((block[slot] = alloc_zeroed_block(pt)) == 0) {
+                                free(block);
+                                return -1;
+                        }
+                        (*meta)++;
+                } else {
+                        parent = block[slot];
+                        free(block);
+                        continue;
+                }
+                write_block(pt, parent, 1, (char *)block);
+                parent = block[slot];
+                free(block);
+        }
+
+        return 0;
+}
+
+// pack entries from next on into a block from offset on, the last one
+// placed takes the rest of the block. Returns its offset, -1 for none.
+static int fill_dir_block(char *block, int offset, int block_size, slice_t *entries, int *next)
+{
+        struct ext2_dir_entry_2 dir;
+        int last = -1;
+
+        while (*next < entries->len) {
+                get(entries, *next, &dir);
+                dir.rec_len = compute_rec_len(&dir);
+                if (offset + dir.rec_len > block_size) {
+                        break;
+                }
+                memcpy(block+offset, &dir, 8 + dir.name_len);
+                last = offset;
+                offset += dir.rec_len;
+                (*next)++;
+        }
+        if (last >= 0) {
+                ((struct ext2_dir_entry_2 *)(block + last))->rec_len += block_size - offset;
+        }
 
-        char **block_array = allocate_inode_block(pt);
+        return last;
+}
+
+// append entries to lost+found, first into the room at the end of its
+// blocks, then into new blocks. Every block is written once and nothing
+// already there moves. Returns how many entries were linked.
+static int append_lost_found(partition_t *pt, int lost_found_inode, slice_t *entries)
+{
+        int block_size = get_block_size(pt);
+        int next = 0;
+        int changed = 0;
+
+        slice_t *blocks = get_blocks(pt, lost_found_inode);
+        for (int b = 0; b < blocks->len && next < entries->len; b++) {
+                int block_id;
+                get(blocks, b, &block_id);
+                char *block = read_block(pt, block_id, 1);
+
+                // the last entry of the chain, which holds the free room
+                int offset = 0, last = -1;
+                while (offset + 8 <= block_size) {
+                        struct ext2_dir_entry_2 *dir = (struct ext2_dir_entry_2 *)(block + offset);
+                        if (dir->rec_len < 8 || offset + dir->rec_len > block_size) {
+                                break;
+                        }
+                        if (offset + dir->rec_len == block_size) {
+                                last = offset;
+                                break;
+                        }
+                        offset += dir->rec_len;
+                }
+                if (last < 0) {
+                        // a damaged chain is left alone
+                        free(block);
+                        continue;
+                }
 
-        int *dirty_array = calloc(1, sizeof(int) * total_blocks);
-        if (!dirty_array) {
+                struct ext2_dir_entry_2 *last_dir = (struct ext2_dir_entry_2 *)(block + last);
+                int start = last_dir->inode == 0 ? last : last + compute_rec_len(last_dir);
+                if (fill_dir_block(block, start, block_size, entries, &next) >= 0) {
+                        if (start != last) {
+                                last_dir->rec_len = start - last;
+                        }
+                        write_block(pt, block_id, 1, block);
+                        changed = 1;
+                }
+                free(block);
+        }
+
+        int index = blocks->len;
+        delete_slice(blocks);
+
+        if (next < entries->len) {
+                // the scan walks every inode table, take the entry after it
+                scan_owned_blocks(pt);
+        }
+        struct ext2_inode *entry = pin_inode_entry(pt, lost_found_inode);
+        int sectors = block_size / 512;
+
+        char *block_buf = malloc(block_size);
+        if (!block_buf) {
                 error_at_line(-1, errno, __FILE__, __LINE__, NULL);
         }
+        while (next < entries->len) {
+                int block_id = alloc_dir_block(pt);
+                if (block_id == 0) {
+                        break;
+                }
+                int meta = 0;
+                int ret = map_dir_block(pt, entry, index, block_id, &meta);
+                entry->i_blocks += meta * sectors;
+                if (ret < 0) {
+                        release_block(pt, block_id);
+                        break;
+                }
+
+                memset(block_buf, 0, block_size);
+                fill_dir_block(block_buf, 0, block_size, entries, &next);
+                write_block(pt, block_id, 1, block_buf);
+                entry->i_blocks += sectors;
+                index++;
+                changed = 1;
+        }
+        free(block_buf);
+
+        if (next < entries->len) {
+                printf("WARNING: lost+found is full, %d inodes left unconnected\n", entries->len - next);
+        }
+
+        if (changed) {
+                if (entry->i_size < index * block_size) {
+                        entry->i_size = index * block_size;
+                }
+                // the hash index no longer covers every entry
+                entry->i_flags &= ~EXT2_INDEX_FL;
+                mark_inode_dirty(pt, lost_found_inode);
+                dcache_invalidate(pt->dcache, lost_found_inode);
+        }
+        unpin_inode_entry(pt, lost_found_inode);
+
+        return next;
+}
+
+// point '..' of each reconnected directory at lost+found, in the order of
+// their first blocks so the writes sweep the disk once
+static int change_parent_inodes(partition_t *pt, slice_t *dirs, int parent_inode)
+{
+        int block_size = get_block_size(pt);
+
+        // pairs of (first block, inode)
+        slice_t *pairs = make_slice(dirs->len + 1, sizeof(int) * 2);
+        for (int i = 0; i < dirs->len; i++) {
+                int pair[2];
+                get(dirs, i, &pair[1]);
+                pair[0] = get_inode_entry(pt, pair[1])->i_block[0];
+                if (pair[0] != 0) {
+                        append(pairs, pair);
+                }
+        }
+        qsort(pairs->array, pairs->len, sizeof(int) * 2, compare_pair);
+
+        int *items = (int *)pairs->array;
+        for (int i = 0; i < pairs->len; i++) {
+                char *block = read_block(pt, items[i*2], 1);
+
+                // '..' follows '.', whatever rec_len '.' was given
+                struct ext2_dir_entry_2 *dot = (struct ext2_dir_entry_2 *)block;
+                if (dot->rec_len >= 12 && dot->rec_len + 12 <= block_size) {
+                        struct ext2_dir_entry_2 *dotdot = (struct ext2_dir_entry_2 *)(block + dot->rec_len);
+                        if (dotdot->name_len == 2 && strncmp(dotdot->name, "..", 2) == 0) {
+                                dotdot->inode = parent_inode;
+                                write_block(pt, items[i*2], 1, block);
+                        }
+                }
+                dcache_invalidate(pt->dcache, items[i*2+1]);
+                free(block);
+        }
+
+        delete_slice(pairs);
+        return 0;
+}
+
+static int link_to_lost_found(partition_t *pt, slice_t *lost_found, slice_t *dirs, int inode)
+{
+        struct ext2_dir_entry_2 lost_dir;
+
+        printf("Unconnected directory inode %d\n", inode);
+        create_lost_dir(pt, &lost_dir, inode);
+        if (is_dir(pt, inode)) {
+                append(dirs, &inode);
+        }
+        append(lost_found, &lost_dir);
+
+        return 0;
+}
+
+static int fix_idle_inodes(partition_t *pt)
+{
+        int add_lost_found = 0;
 
-        // start from root
-        for (int i = 2; i < book_size; i++) {
-                struct ext2_inode *entry = get_inode_entry(pt, i);
-                if (entry->i_links_count == inode_book[i]) {
+        int lost_found_inode = get_lost_found_inode(pt);
+
+        // entries to append to lost+found and the directories among them
+        slice_t *lost_found = make_slice(64, sizeof(struct ext2_dir_entry_2));
+        slice_t *lost_dirs = make_slice(64, sizeof(int));
+
+        // collect every unreferenced inode
+        slice_t *candidates = make_slice(1024, sizeof(int));
+        int inodes_per_group = get_inodes_per_group(pt);
+        for (int g = 0; g < pt->group_count; g++) {
+                if (!lc_group_active(inode_book, g)) {
                         continue;
                 }
-                printf("Inode %d ref count is %d, should be %d.\n", i, entry->i_links_count, inode_book[i]);
-                entry->i_links_count = inode_book[i];
-                modify_inode_block_array(pt, block_array, dirty_array, i, entry);
-                // modify entry and store it in block
+                for (int i = g * inodes_per_group + 1; i <= (g + 1) * inodes_per_group; i++) {
+                        if (i >= EXT2_FIRST_INO(pt->super_block) && is_unreferenced(pt, i)) {
+                                append(candidates, &i);
+                        }
+                }
         }
 
-        for (int i = 0; i < total_blocks; i++) {
-                if (dirty_array[i]) {
-                        //printf("%d \n", index_to_bid(pt, i));
-                        write_block(pt, index_to_bid(pt, i), 1, block_array[i]);
+        // one search seeded from all candidate directories counts the
+        // references among the disconnected subtrees, so only the roots of
+        // those subtrees stay unreferenced
+        char *visited = calloc_inode_bitmap(pt);
+        list_t *queue = ll_new_list(sizeof(int));
+        int inode;
+        for (int i = 0; i < candidates->len; i++) {
+                get(candidates, i, &inode);
+                if (is_dir(pt, inode)) {
+                        SET_BIT(visited, inode);
+                        ll_append(queue, &inode);
                 }
         }
+        count_search(queue, pt, mark_only_child_inodes_in_book, visited);
+
+        // connect the roots, then any directory still not below a connected
+        // root sits on a cycle of orphans and the first one found is
+        // connected in its place
+        memset(visited, 0, pt->super_block->s_inodes_count / MAP_UNIT_SIZE + 1);
+        for (int round = 0; round < 2; round++) {
+                for (int i = 0; i < candidates->len; i++) {
+                        get(candidates, i, &inode);
+                        if (round == 0 && lc_get(inode_book, inode) != 0) {
+                                continue;
+                        }
+                        // files an orphan directory refers to are connected
+                        // with it, only directories can be left on a cycle
+                        if (round == 1 && (!is_dir(pt, inode) || GET_BIT(visited, inode))) {
+                                continue;
+                        }
 
-        free(dirty_array);
+                        link_to_lost_found(pt, lost_found, lost_dirs, inode);
+                        add_lost_found = 1;
 
-        for (int i = 0; i < total_blocks; i++) {
-                free(block_array[i]);
+                        SET_BIT(visited, inode);
+                        if (is_dir(pt, inode)) {
+                                ll_append(queue, &inode);
+                                breadth_search_marked(queue, pt, NULL, visited);
+                        }
+                }
+        }
+
+        ll_delete_list(queue);
+        spill_free(visited, inode_bitmap_size(pt));
+        delete_slice(candidates);
+
+        if (add_lost_found && lost_found_inode > 0) {
+                append_lost_found(pt, lost_found_inode, lost_found);
+                change_parent_inodes(pt, lost_dirs, lost_found_inode);
+                write_dirty_bitmaps(pt);
+
+                if (owned_blocks) {
+                        spill_free(owned_blocks, block_bitmap_size(pt));
+                        owned_blocks = NULL;
+                }
+        }
+
+        delete_slice(lost_dirs);
+        delete_slice(lost_found);
+        return add_lost_found;
+}
+
+static int fix_inodes_count(partition_t *pt)
+{
+        int inodes_per_group = get_inodes_per_group(pt);
+
+        for (int g = 0; g < pt->group_count; g++) {
+                if (!lc_group_active(inode_book, g)) {
+                        continue;
+                }
+
+                // start from root, reserved inodes are not counted by directories
+                for (int i = g * inodes_per_group + 1; i <= (g + 1) * inodes_per_group; i++) {
+                        if (i < EXT2_FIRST_INO(pt->super_block) && i != EXT2_ROOT_INO) {
+                                continue;
+                        }
+                        struct ext2_inode *entry = get_inode_entry(pt, i);
+                        int count = lc_get(inode_book, i);
+                        if (entry->i_links_count == count) {
+                                continue;
+                        }
+                        printf("Inode %d ref count is %d, should be %d.\n", i, entry->i_links_count, count);
+                        entry->i_links_count = count;
+                        mark_inode_dirty(pt, i);
+                }
         }
-        free(block_array);
 
         return 0;
 }
@@ -562,7 +1406,7 @@ int check_inode_ptr(partition_t *pt)
         int root_inode = 2;
         ll_append(queue, &root_inode); // enqueue the root;
 
-        breadth_search(queue, pt, mark_child_inodes_in_book);
+        count_search(queue, pt, mark_child_inodes_in_book, NULL);
 
         ll_delete_list(queue);
 
@@ -577,84 +1421,323 @@ int check_inode_cnt(partition_t *pt)
                 printf("Pass 3: Checking reference counts\n");
         }
 
-        memset(inode_book, 0, book_size*sizeof(int));
+        lc_reset(inode_book);
 
         list_t *queue = ll_new_list(sizeof(int));
 
         int root_inode = 2;
         ll_append(queue, &root_inode); // enqueue the root;
 
-        breadth_search(queue, pt, mark_child_inodes_in_book);
+        count_search(queue, pt, mark_child_inodes_in_book, NULL);
 
         ll_delete_list(queue);
 
         fix_inodes_count(pt);
 
+        lc_delete(inode_book);
+        inode_book = NULL;
+
         return 0;
 }
 
-static int alloc_block_bitmap(partition_t *pt)
+static int lost_found_id; // keeps its blocks for the orphans of later runs
+
+static void free_dir_block(partition_t *pt, int block_id)
+{
+        release_block(pt, block_id);
+}
+
+// free the indirect blocks of a tree, depth 1 for an indirect block whose
+// data blocks are freed by the caller, returns how many were freed
+static int free_indirect_tree(partition_t *pt, int block_id, int depth)
 {
-        block_num = get_block_size(pt) * pt->group_count * MAP_UNIT_SIZE;
-        block_bmap = (char *)calloc(sizeof(char), block_num / MAP_UNIT_SIZE);
-        if (!block_bmap) {
+        int entries_per_block = get_block_size(pt) / 4; // 32-bit int
+        int freed = 1;
+
+        if (block_id == 0) {
+                return 0;
+        }
+        if (depth > 1) {
+                int *block = (int *)read_block(pt, block_id, 1);
+                for (int i = 0; i < entries_per_block; i++) {
+                        if (block[i] != 0) {
+                                freed += free_indirect_tree(pt, block[i], depth - 1);
+                        }
+                }
+                free(block);
+        }
+        free_dir_block(pt, block_id);
+
+        return freed;
+}
+
+static inline int is_dot_entry(struct ext2_dir_entry_2 *dir, int name_len)
+{
+        return dir->name_len == name_len && strncmp(dir->name, "..", name_len) == 0;
+}
+
+// repack a directory into as few blocks as its entries need, '.' and '..'
+// first, and free the blocks left over at its end
+static int optimize_dir(partition_t *pt, int inode_id)
+{
+        int block_size = get_block_size(pt);
+        int entries_per_block = block_size / 4; // 32-bit int
+        struct ext2_dir_entry_2 dir;
+
+        if (inode_id == lost_found_id) {
+                return 0;
+        }
+
+        slice_t *blocks = get_blocks(pt, inode_id);
+        int block_count = blocks->len;
+        char **old = malloc(sizeof(char *) * block_count);
+        if (!old && block_count > 0) {
                 error_at_line(-1, errno, __FILE__, __LINE__, NULL);
         }
 
-        // hack
-        for (int i = 0; i < 100; i++) {
-                SET_BIT(block_bmap, i);
+        // every entry in use, '.' and '..' moved to the front
+        slice_t *entries = make_slice(1024, sizeof(struct ext2_dir_entry_2));
+        slice_t *rest = make_slice(1024, sizeof(struct ext2_dir_entry_2));
+        for (int b = 0; b < block_count; b++) {
+                int block_id;
+                get(blocks, b, &block_id);
+                old[b] = read_block(pt, block_id, 1);
+
+                slice_t *s = make_slice(64, sizeof(struct ext2_dir_entry_2));
+                get_block_dirs(pt, old[b], s);
+                for (int i = 0; i < s->len; i++) {
+                        get(s, i, &dir);
+                        append(is_dot_entry(&dir, 1) || is_dot_entry(&dir, 2) ? entries : rest, &dir);
+                }
+                delete_slice(s);
+        }
+        for (int i = 0; i < rest->len; i++) {
+                get(rest, i, &dir);
+                append(entries, &dir);
+        }
+        delete_slice(rest);
+
+        int needed = 1, fill = 0;
+        for (int i = 0; i < entries->len; i++) {
+                get(entries, i, &dir);
+                if (fill + compute_rec_len(&dir) > block_size) {
+                        needed++;
+                        fill = 0;
+                }
+                fill += compute_rec_len(&dir);
+        }
+
+        // nothing to free, or too large to fit below the indirect block
+        if (needed >= block_count || needed > EXT2_NDIR_BLOCKS + entries_per_block) {
+                goto DONE;
+        }
+
+        // only this worker reads the directory, the bitmaps and inode
+        // table its blocks are freed from are shared
+        pthread_mutex_lock(&dir_lock);
+
+        // lay the entries out again, writing the blocks that differ
+        char *block_buf = calloc(1, block_size);
+        if (!block_buf) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        int next = 0;
+        for (int b = 0; b < needed; b++) {
+                memset(block_buf, 0, block_size);
+                int offset = 0, last = 0;
+                while (next < entries->len) {
+                        get(entries, next, &dir);
+                        dir.rec_len = compute_rec_len(&dir);
+                        if (offset + dir.rec_len > block_size) {
+                                break;
+                        }
+                        memcpy(block_buf+offset, &dir, 8 + dir.name_len);
+                        last = offset;
+                        offset += dir.rec_len;
+                        next++;
+                }
+                // the last entry takes the rest of the block
+                ((struct ext2_dir_entry_2 *)(block_buf + last))->rec_len += block_size - offset;
+
+                if (memcmp(block_buf, old[b], block_size) != 0) {
+                        int block_id;
+                        get(blocks, b, &block_id);
+                        write_block(pt, block_id, 1, block_buf);
+                }
+        }
+        free(block_buf);
+
+        // free the data blocks past the end, then the indirect blocks left empty
+        struct ext2_inode *entry = pin_inode_entry(pt, inode_id);
+        for (int b = needed; b < block_count; b++) {
+                int block_id;
+                get(blocks, b, &block_id);
+                free_dir_block(pt, block_id);
+        }
+        for (int b = needed; b < EXT2_NDIR_BLOCKS; b++) {
+                entry->i_block[b] = 0;
+        }
+        int freed = block_count - needed;
+        if (needed <= EXT2_NDIR_BLOCKS) {
+                freed += free_indirect_tree(pt, entry->i_block[EXT2_IND_BLOCK], 1);
+                entry->i_block[EXT2_IND_BLOCK] = 0;
+        } else {
+                int *block = (int *)read_block(pt, entry->i_block[EXT2_IND_BLOCK], 1);
+                memset(block + (needed - EXT2_NDIR_BLOCKS), 0,
+                       sizeof(int) * (entries_per_block - (needed - EXT2_NDIR_BLOCKS)));
+                write_block(pt, entry->i_block[EXT2_IND_BLOCK], 1, (char *)block);
+                free(block);
+        }
+        freed += free_indirect_tree(pt, entry->i_block[EXT2_DIND_BLOCK], 2);
+        freed += free_indirect_tree(pt, entry->i_block[EXT2_TIND_BLOCK], 3);
+        entry->i_block[EXT2_DIND_BLOCK] = 0;
+        entry->i_block[EXT2_TIND_BLOCK] = 0;
+
+        entry->i_size = needed * block_size;
+        entry->i_blocks -= freed * (block_size / 512);
+        entry->i_flags &= ~EXT2_INDEX_FL;
+        mark_inode_dirty(pt, inode_id);
+        unpin_inode_entry(pt, inode_id);
+        dcache_invalidate(pt->dcache, inode_id);
+
+        printf("Directory inode %d optimized, %d blocks freed\n", inode_id, freed);
+        pthread_mutex_unlock(&dir_lock);
+
+DONE:
+        for (int b = 0; b < block_count; b++) {
+                free(old[b]);
         }
+        free(old);
+        delete_slice(entries);
+        delete_slice(blocks);
+
         return 0;
 }
 
-static int mark_child_blocks_in_book(partition_t *pt, int inode)
+// pass 3A, only run when asked for
+int optimize_directories(partition_t *pt)
 {
-        int i, j;
-        int inode_id, block_id;
-        slice_t *child_slice, *blocks;
+        printf("Pass 3A: Optimizing directories\n");
 
-        child_slice = get_child_inodes(pt, inode);
-        for (i = 0; i < child_slice->len; i++) {
-                get(child_slice, i, &inode_id);
+        lost_found_id = get_lost_found_inode(pt);
 
-                //printf("child inode_id %d\n", inode_id);
-                if (inode_id > book_size) {
-                        continue;
-                }
+        list_t *queue = ll_new_list(sizeof(int));
+        int root_inode = 2;
+        ll_append(queue, &root_inode); // enqueue the root;
+        breadth_search(queue, pt, optimize_dir);
+        ll_delete_list(queue);
 
-                if (is_symbol(pt, inode_id)) {
-                        // do not count symbolic link
-                        continue;
-                }
+        write_dirty_bitmaps(pt);
+
+        return 0;
+}
+
+static int alloc_block_bitmap(partition_t *pt)
+{
+        block_num = block_bitmap_size(pt) * MAP_UNIT_SIZE;
+        block_bmap = spill_calloc(1, block_bitmap_size(pt));
 
-                blocks = get_allocated_blocks(pt, inode_id);
+        dup_owners = make_slice(16, sizeof(int) * 2);
+        return 0;
+}
 
-                for (j = 0; j < blocks->len; j++) {
-                        get(blocks, j, &block_id);
-                        SET_BIT(block_bmap, block_id);
+static int compare_int(const void *a, const void *b)
+{
+        return *(const int *)a - *(const int *)b;
+}
+
+// every block in dup_owners was marked by one inode before those recorded
+// there. Only when there are duplicates, the in-use inodes are walked
+// again until each block has that first owner, who joins the others.
+static void find_first_owners(partition_t *pt)
+{
+        if (dup_owners->len == 0) {
+                return;
+        }
+
+        qsort(dup_owners->array, dup_owners->len, sizeof(int) * 2, compare_pair);
+        int *pairs = (int *)dup_owners->array;
+        int recorded = dup_owners->len;
+
+        // the duplicate blocks, sorted and unique, and the first owner of each
+        int *blocks = malloc(sizeof(int) * recorded);
+        int *owners = calloc(recorded, sizeof(int));
+        if (!blocks || !owners) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        int count = 0;
+        for (int i = 0; i < recorded; i++) {
+                if (count == 0 || blocks[count-1] != pairs[i*2]) {
+                        blocks[count++] = pairs[i*2];
                 }
-                delete_slice(blocks);
         }
 
-        delete_slice(child_slice);
-        return 0;
+        int missing = count;
+        int inodes_per_group = get_inodes_per_group(pt);
+        for (int g = 0; g < pt->group_count && missing > 0; g++) {
+                char *inode_bitmap = pt->groups[g]->inode_bitmap;
+                for (int i = 0; i < inodes_per_group && missing > 0; i++) {
+                        if (i % MAP_UNIT_SIZE == 0 && inode_bitmap[i / MAP_UNIT_SIZE] == 0) {
+                                i += MAP_UNIT_SIZE - 1; // skip a whole free byte
+                                continue;
+                        }
+                        if (!GET_BIT(inode_bitmap, i+1)) {
+                                continue;
+                        }
+                        int inode_id = g * inodes_per_group + i + 1;
+                        slice_t *list = owned_block_list(pt, inode_id);
+                        if (!list) {
+                                continue;
+                        }
+                        for (int j = 0; j < list->len; j++) {
+                                int pair[2] = {0, inode_id};
+                                get(list, j, &pair[0]);
+                                int *b = bsearch(&pair[0], blocks, count, sizeof(int), compare_int);
+                                if (!b || owners[b - blocks]
+                                    || bsearch(pair, pairs, recorded, sizeof(int) * 2, compare_pair)) {
+                                        continue;
+                                }
+                                owners[b - blocks] = inode_id;
+                                missing--;
+                        }
+                        delete_slice(list);
+                }
+        }
+
+        for (int i = 0; i < count; i++) {
+                if (owners[i]) {
+                        int pair[2] = {blocks[i], owners[i]};
+                        append(dup_owners, pair);
+                }
+        }
+        free(owners);
+        free(blocks);
 }
 
-static int is_pre_allocated(partition_t *pt, int id)
+// print every claimant of each duplicate block, an inode listing a block
+// twice is recorded twice
+static int report_dup_blocks(partition_t *pt)
 {
-        int inodes_size = get_inodes_per_group(pt) *  sizeof(struct ext2_inode);
-        int inodes_blocks = (inodes_size + get_block_size(pt) - 1) / get_block_size(pt);
+        if (dup_owners->len == 0) {
+                return 0;
+        }
 
-        for (int i = 0; i < pt->group_count; i++) {
-                int start = i * get_blocks_per_group(pt);
-                int inodes_table_start = get_inode_table_bid(pt->groups[i]);
-                int end = inodes_table_start + inodes_blocks;
-                if (id >= start && id < end) {
-                        return 1;
+        qsort(dup_owners->array, dup_owners->len, sizeof(int) * 2, compare_pair);
+        int *pairs = (int *)dup_owners->array;
+        int blocks = 0;
+        for (int i = 0; i < dup_owners->len; i++) {
+                if (i > 0 && pairs[i*2] == pairs[(i-1)*2] && pairs[i*2+1] == pairs[(i-1)*2+1]) {
+                        continue;
+                }
+                if (i == 0 || pairs[i*2] != pairs[(i-1)*2]) {
+                        printf("%sMultiply-claimed block %d, claimed by inodes", i == 0 ? "" : "\n", pairs[i*2]);
+                        blocks++;
                 }
+                printf(" %d", pairs[i*2+1]);
         }
-        return 0;
+        printf("\n");
+
+        return blocks;
 }
 
 static inline void fix_bit(int i, int v)
@@ -690,12 +1773,20 @@ static int fix_block_bitmap(partition_t *pt)
                 }
         }
 
-        // write back the bitmap
+        // write back the sectors that differ
         if (changed) {
                 for (int i = 0; i < pt->group_count; i++) {
-                        int bitmap_block_start = get_block_bitmap_bid(pt->groups[i]);
-                        write_block(pt, bitmap_block_start, 1, block_bmap+i*get_block_size(pt));
+                        group_t *g = pt->groups[i];
+                        char *fixed = block_bmap + i*get_block_size(pt);
+                        for (int j = 0; j < get_block_size(pt) / sector_size_bytes; j++) {
+                                int offset = j * sector_size_bytes;
+                                if (memcmp(g->block_bitmap + offset, fixed + offset, sector_size_bytes) != 0) {
+                                        memcpy(g->block_bitmap + offset, fixed + offset, sector_size_bytes);
+                                        g->bitmap_dirty[j] = 1;
+                                }
+                        }
                 }
+                flush_block_bitmaps(pt);
         }
         return 0;
 }
@@ -706,41 +1797,204 @@ int check_block_bitmap(partition_t *pt)
 
         alloc_block_bitmap(pt);
 
-        list_t *queue = ll_new_list(sizeof(int));
+        scan_inode_tables(pt, block_bmap, dup_owners);
+        find_first_owners(pt);
+        report_dup_blocks(pt);
+        mark_reserved_blocks(block_bmap);
 
-        int root_inode = 2;
-        slice_t *blocks = get_blocks(pt, 2);
-        for (int j = 0; j < blocks->len; j++) {
-                int block_id;
-                get(blocks, j, &block_id);
-                SET_BIT(block_bmap, block_id);
+        fix_block_bitmap(pt);
+
+        delete_slice(dup_owners);
+        dup_owners = NULL;
+
+        return 0;
+}
+
+// count the directories in use in a group from the in-memory inode table
+static int count_used_dirs(partition_t *pt, int group_number)
+{
+        int used_dirs = 0;
+        int inodes_per_group = get_inodes_per_group(pt);
+        char *inode_bitmap = pt->groups[group_number]->inode_bitmap;
+
+        for (int i = 0; i < inodes_per_group; i++) {
+                if (i % MAP_UNIT_SIZE == 0 && inode_bitmap[i / MAP_UNIT_SIZE] == 0) {
+                        i += MAP_UNIT_SIZE - 1; // skip a whole free byte
+                        continue;
+                }
+                if (GET_BIT(inode_bitmap, i+1) && is_dir(pt, group_number * inodes_per_group + i + 1)) {
+                        used_dirs++;
+                }
         }
 
-        ll_append(queue, &root_inode); // enqueue the root;
+        return used_dirs;
+}
 
-        breadth_search(queue, pt, mark_child_blocks_in_book);
+int check_group_summary(partition_t *pt)
+{
+        printf("Pass 5: Checking group summary counts\n");
 
-        fix_block_bitmap(pt);
+        int desc_changed = 0;
+        int free_blocks_total = 0;
+        int free_inodes_total = 0;
+        int inodes_per_group = get_inodes_per_group(pt);
 
-        ll_delete_list(queue);
-        delete_slice(blocks);
+        for (int i = 0; i < pt->group_count; i++) {
+                struct ext2_group_desc *desc = pt->groups[i]->desc;
+                int blocks_in_group = get_blocks_in_group(pt, i);
+
+                int free_blocks = blocks_in_group -
+                        count_set_bits(block_bmap + i*get_block_size(pt), blocks_in_group);
+                int free_inodes = inodes_per_group -
+                        count_set_bits(pt->groups[i]->inode_bitmap, inodes_per_group);
+                int used_dirs = count_used_dirs(pt, i);
+
+                if (desc->bg_free_blocks_count != free_blocks) {
+                        printf("Free blocks count wrong for group #%d (%d, counted=%d).\n",
+                               i, desc->bg_free_blocks_count, free_blocks);
+                        desc->bg_free_blocks_count = free_blocks;
+                        desc_changed = 1;
+                }
+                if (desc->bg_free_inodes_count != free_inodes) {
+                        printf("Free inodes count wrong for group #%d (%d, counted=%d).\n",
+                               i, desc->bg_free_inodes_count, free_inodes);
+                        desc->bg_free_inodes_count = free_inodes;
+                        desc_changed = 1;
+                }
+                if (desc->bg_used_dirs_count != used_dirs) {
+                        printf("Directories count wrong for group #%d (%d, counted=%d).\n",
+                               i, desc->bg_used_dirs_count, used_dirs);
+                        desc->bg_used_dirs_count = used_dirs;
+                        desc_changed = 1;
+                }
+
+                free_blocks_total += free_blocks;
+                free_inodes_total += free_inodes;
+        }
+
+        int super_changed = 0;
+        struct ext2_super_block *sb = pt->super_block;
+        if (sb->s_free_blocks_count != free_blocks_total) {
+                printf("Free blocks count wrong (%d, counted=%d).\n", sb->s_free_blocks_count, free_blocks_total);
+                sb->s_free_blocks_count = free_blocks_total;
+                super_changed = 1;
+        }
+        if (sb->s_free_inodes_count != free_inodes_total) {
+                printf("Free inodes count wrong (%d, counted=%d).\n", sb->s_free_inodes_count, free_inodes_total);
+                sb->s_free_inodes_count = free_inodes_total;
+                super_changed = 1;
+        }
+
+        // one write for the whole descriptor table and one for the superblock
+        if (desc_changed) {
+                write_group_desc_table(pt);
+        }
+        if (super_changed) {
+                write_super_block(pt);
+        }
 
         return 0;
 }
 
 int do_check(partition_t *pt)
 {
+        // with a writeback thread, the repairs of a pass are written while
+        // the next one runs
         pass++;
         check_dir_ptrs(pt);
+        plan_writeback();
 
         pass++;
         check_inode_ptr(pt);
+        plan_writeback();
 
         pass++;
         check_inode_cnt(pt);
+        plan_writeback();
+
+        if (optimize_dirs) {
+                optimize_directories(pt);
+                plan_writeback();
+        }
 
         pass++;
         check_block_bitmap(pt);
+        plan_writeback();
+
+        pass++;
+        check_group_summary(pt);
+
+        spill_free(block_bmap, block_bitmap_size(pt));
+        block_bmap = NULL;
+
+        flush_inode_tables(pt);
 
         return 0;
 }
+
+#ifdef TESTPARALLEL
+
+#include <zlib.h>
+
+int pass = 0;
+int jobs = 1;
+long long max_memory = 0;
+int optimize_dirs = 0;
+const char *io_backend = "pread";
+int read_only = 1;
+
+static uLong plan_crc;
+
+static void digest_run(int64_t start_sector, unsigned int num_sectors, const void *from)
+{
+        plan_crc = crc32(plan_crc, (const Bytef *)&start_sector, sizeof(start_sector));
+        plan_crc = crc32(plan_crc, from, num_sectors * sector_size_bytes);
+}
+
+// check a partition under a repair plan with some threads, the digest of
+// the planned writes
+static uLong planned_repairs(char *image, int partition, int threads)
+{
+        disk_t disk;
+
+        jobs = threads;
+        pass = 0;
+        plan_init();
+        open_disk(image, &disk, 1);
+        if (partition < 1 || partition > disk.partition_count
+            || !is_ext2_partition(disk.partitions[partition-1])) {
+                printf("no ext2 partition %d\n", partition);
+                exit(-1);
+        }
+        do_check(disk.partitions[partition-1]);
+        free_disk(&disk);
+
+        plan_crc = crc32(0L, Z_NULL, 0);
+        plan_drain(digest_run);
+        plan_close();
+
+        return plan_crc;
+}
+
+// check an image with one thread and with several, nothing is written.
+// Both must plan the same repairs, a damaged image shows more than a
+// clean one.
+int main(int argc, char *argv[])
+{
+        if (argc < 3) {
+                printf("usage: %s <disk image> <threads> [partition number]\n", argv[0]);
+                return -1;
+        }
+        int threads = atoi(argv[2]);
+        int partition = argc > 3 ? atoi(argv[3]) : 1;
+
+        uLong serial = planned_repairs(argv[1], partition, 1);
+        uLong parallel = planned_repairs(argv[1], partition, threads);
+
+        printf("repairs with 1 thread %08lx, with %d threads %08lx: %s\n",
+               serial, threads, parallel, serial == parallel ? "same" : "DIFFERENT");
+
+        return serial != parallel;
+}
+
+#endif
@@ -0,0 +1,488 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "chunked.h"
+
+#define CHUNKED_MAGIC "MYFSCHNK"
+#define CHUNKED_VERSION 1
+
+#define CHUNKED_DEFAULT_CHUNK_SIZE (64 * 1024)
+#define CHUNKED_MAX_CHUNK_SIZE (16 * 1024 * 1024)
+
+// decompressed chunks kept, least recently used goes first
+#define CHUNKED_CACHE_SLOTS 64
+// threads decompressing the chunks reads miss
+#define CHUNKED_THREADS 4
+// chunks queued ahead of a read that follows the one before it
+#define CHUNKED_PREFETCH 4
+
+extern const unsigned int sector_size_bytes;
+
+// header of a chunked image. The chunks follow it, each compressed on its
+// own, then an index of chunk_count + 1 offsets, chunk c is the bytes from
+// index[c] to index[c + 1]. An empty chunk is all zeroes, one as long as
+// its data is stored as it is.
+typedef struct chunked_header_s {
+        char magic[8];
+        uint32_t version;
+        uint32_t chunk_size;
+        uint64_t image_size;
+        uint64_t chunk_count;
+        uint64_t index_offset;
+} chunked_header_t;
+
+typedef struct chunk_slot_s {
+        int64_t chunk;
+        char *data;
+        uint64_t last_used;
+} chunk_slot_t;
+
+static int chunked_fd = -1;
+static chunked_header_t header;
+static uint64_t *index_table = NULL;
+
+static chunk_slot_t cache[CHUNKED_CACHE_SLOTS];
+static uint64_t tick = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// chunks waiting for a worker, a slot holding one of them has no data yet
+static int64_t queue[CHUNKED_CACHE_SLOTS];
+static uint64_t queue_head = 0;
+static uint64_t queue_tail = 0;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;  // workers wait on it
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;  // readers wait on it
+static pthread_t workers[CHUNKED_THREADS];
+static int stopping = 0;
+static int64_t next_sector = -1; // where the last read ended
+
+static int read_header(int fd, chunked_header_t *h)
+{
+        if (pread(fd, h, sizeof(*h), 0) != sizeof(*h)
+            || memcmp(h->magic, CHUNKED_MAGIC, sizeof(h->magic)) != 0) {
+                return -1;
+        }
+        if (h->version != CHUNKED_VERSION || h->chunk_size == 0
+            || h->chunk_size % sector_size_bytes != 0 || h->chunk_size > CHUNKED_MAX_CHUNK_SIZE
+            || h->chunk_count != (h->image_size + h->chunk_size - 1) / h->chunk_size) {
+                return -1;
+        }
+        return 0;
+}
+
+// the size of an image in a chunked file at path, -1 when it is not one
+int64_t chunked_probe(const char *path)
+{
+        chunked_header_t h;
+        int fd = open(path, O_RDONLY);
+        if (fd < 0) {
+                return -1;
+        }
+        int ret = read_header(fd, &h);
+        close(fd);
+
+        return ret < 0 ? -1 : h.image_size;
+}
+
+static inline size_t chunk_length(int64_t chunk)
+{
+        uint64_t begin = (uint64_t)chunk * header.chunk_size;
+        uint64_t left = header.image_size - begin;
+        return left < header.chunk_size ? left : header.chunk_size;
+}
+
+// copy the part of chunk that falls in [start, end) of the image to into
+static void copy_part(int64_t chunk, const char *data, uint64_t start, uint64_t end, char *into)
+{
+        uint64_t begin = (uint64_t)chunk * header.chunk_size;
+        uint64_t lo = start > begin ? start : begin;
+        uint64_t hi = begin + chunk_length(chunk);
+        if (hi > end) {
+                hi = end;
+        }
+        memcpy(into + (lo - start), data + (lo - begin), hi - lo);
+}
+
+static char *decompress_chunk(int64_t chunk)
+{
+        size_t length = chunk_length(chunk);
+        size_t stored = index_table[chunk + 1] - index_table[chunk];
+        char *data = malloc(header.chunk_size);
+        if (!data) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        if (stored == 0) {
+                memset(data, 0, length);
+        } else if (stored == length) {
+                if (pread(chunked_fd, data, length, index_table[chunk]) != length) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, "read chunk %lld", (long long)chunk);
+                }
+        } else {
+                char *packed = malloc(stored);
+                if (!packed) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                if (pread(chunked_fd, packed, stored, index_table[chunk]) != stored) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, "read chunk %lld", (long long)chunk);
+                }
+                uLongf out = length;
+                if (uncompress((Bytef *)data, &out, (Bytef *)packed, stored) != Z_OK || out != length) {
+                        error_at_line(-1, 0, __FILE__, __LINE__, "chunk %lld is corrupt", (long long)chunk);
+                }
+                free(packed);
+        }
+
+        return data;
+}
+
+// the slot holding chunk, -1 when it is neither cached nor queued.
+// Called with cache_lock held.
+static int cache_find(int64_t chunk)
+{
+        for (int i = 0; i < CHUNKED_CACHE_SLOTS; i++) {
+                if (cache[i].chunk == chunk) {
+                        return i;
+                }
+        }
+        return -1;
+}
+
+// give chunk a slot and queue it for the workers, unless it has one
+// already. The least recently used decompressed chunk goes; chunks still
+// queued never do. Returns -1 when every slot is waiting on a worker.
+// Called with cache_lock held.
+static int cache_request(int64_t chunk)
+{
+        int victim = -1;
+
+        int slot = cache_find(chunk);
+        if (slot >= 0) {
+                cache[slot].last_used = ++tick;
+                return slot;
+        }
+        for (int i = 0; i < CHUNKED_CACHE_SLOTS; i++) {
+                if (cache[i].chunk >= 0 && !cache[i].data) {
+                        continue;
+                }
+                if (victim < 0 || cache[i].last_used < cache[victim].last_used) {
+                        victim = i;
+                }
+        }
+        if (victim < 0) {
+                return -1;
+        }
+        free(cache[victim].data);
+        cache[victim].chunk = chunk;
+        cache[victim].data = NULL;
+        cache[victim].last_used = ++tick;
+
+        // at most one entry per slot is queued, so the queue never fills
+        queue[queue_tail++ % CHUNKED_CACHE_SLOTS] = chunk;
+        pthread_cond_signal(&work);
+
+        return victim;
+}
+
+static void *decompress_worker(void *arg)
+{
+        pthread_mutex_lock(&cache_lock);
+        for (;;) {
+                while (queue_head == queue_tail && !stopping) {
+                        pthread_cond_wait(&work, &cache_lock);
+                }
+                if (stopping) {
+                        break;
+                }
+                int64_t chunk = queue[queue_head++ % CHUNKED_CACHE_SLOTS];
+                pthread_mutex_unlock(&cache_lock);
+
+                char *data = decompress_chunk(chunk);
+
+                pthread_mutex_lock(&cache_lock);
+                int slot = cache_find(chunk);
+                cache[slot].data = data;
+                cache[slot].last_used = ++tick;
+                pthread_cond_broadcast(&done);
+        }
+        pthread_mutex_unlock(&cache_lock);
+
+        return NULL;
+}
+
+// read the image through fd from now on when it is a chunked file, and
+// start the threads decompressing its chunks. Returns -1 when it is a
+// plain image.
+int chunked_open(int fd)
+{
+        if (read_header(fd, &header) < 0) {
+                return -1;
+        }
+        size_t bytes = (header.chunk_count + 1) * sizeof(uint64_t);
+        index_table = malloc(bytes);
+        if (!index_table) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        if (pread(fd, index_table, bytes, header.index_offset) != bytes) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "truncated chunk index");
+        }
+        for (uint64_t c = 0; c < header.chunk_count; c++) {
+                if (index_table[c] > index_table[c + 1]) {
+                        error_at_line(-1, 0, __FILE__, __LINE__, "corrupt chunk index");
+                }
+        }
+        for (int i = 0; i < CHUNKED_CACHE_SLOTS; i++) {
+                cache[i].chunk = -1;
+                cache[i].data = NULL;
+                cache[i].last_used = 0;
+        }
+        queue_head = 0;
+        queue_tail = 0;
+        stopping = 0;
+        next_sector = -1;
+        chunked_fd = fd;
+
+        for (int i = 0; i < CHUNKED_THREADS; i++) {
+                int err = pthread_create(&workers[i], NULL, decompress_worker, NULL);
+                if (err) {
+                        error_at_line(-1, err, __FILE__, __LINE__, NULL);
+                }
+        }
+
+        return 0;
+}
+
+// read sectors of the image, from the cache or having the workers
+// decompress the chunks they fall in. A read that starts where the last
+// one ended queues the chunks after it too.
+void chunked_read(int64_t start_sector, unsigned int num_sectors, void *into)
+{
+        uint64_t start = (uint64_t)start_sector * sector_size_bytes;
+        uint64_t end = start + (uint64_t)num_sectors * sector_size_bytes;
+        if (end > header.image_size) {
+                error_at_line(-1, 0, __FILE__, __LINE__, "read past the end of the image");
+        }
+        int64_t first = start / header.chunk_size;
+        int64_t last = (end - 1) / header.chunk_size;
+        int64_t expected = __atomic_exchange_n(&next_sector, start_sector + num_sectors, __ATOMIC_RELAXED);
+
+        pthread_mutex_lock(&cache_lock);
+        for (int64_t c = first; c <= last; c++) {
+                if (cache_request(c) < 0) {
+                        break;
+                }
+        }
+        if (expected == start_sector) {
+                for (int64_t c = last + 1; c <= last + CHUNKED_PREFETCH && c < header.chunk_count; c++) {
+                        if (cache_request(c) < 0) {
+                                break;
+                        }
+                }
+        }
+        for (int64_t c = first; c <= last; c++) {
+                int slot;
+                // a chunk may have no slot yet when the read spans more
+                // chunks than the cache holds
+                while ((slot = cache_request(c)) < 0 || !cache[slot].data) {
+                        pthread_cond_wait(&done, &cache_lock);
+                }
+                copy_part(c, cache[slot].data, start, end, into);
+                cache[slot].last_used = ++tick;
+        }
+        pthread_mutex_unlock(&cache_lock);
+}
+
+void chunked_close(void)
+{
+        if (chunked_fd < 0) {
+                return;
+        }
+        pthread_mutex_lock(&cache_lock);
+        stopping = 1;
+        pthread_cond_broadcast(&work);
+        pthread_mutex_unlock(&cache_lock);
+        for (int i = 0; i < CHUNKED_THREADS; i++) {
+                pthread_join(workers[i], NULL);
+        }
+
+        for (int i = 0; i < CHUNKED_CACHE_SLOTS; i++) {
+                free(cache[i].data);
+                cache[i].data = NULL;
+                cache[i].chunk = -1;
+        }
+        free(index_table);
+        index_table = NULL;
+        chunked_fd = -1;
+}
+
+static void chunked_readv(sector_run_t *runs, int count)
+{
+        for (int i = 0; i < count; i++) {
+                chunked_read(runs[i].start_sector, runs[i].num_sectors, runs[i].buf);
+        }
+}
+
+static void chunked_write(int64_t start_sector, unsigned int num_sectors, const void *from)
+{
+        error_at_line(-1, 0, __FILE__, __LINE__, "a compressed image is read only");
+}
+
+static int chunked_flush(void)
+{
+        return 0;
+}
+
+static int64_t chunked_size(void)
+{
+        return header.image_size / sector_size_bytes;
+}
+
+static void chunked_hint(int64_t start_sector, int64_t num_sectors, int advice)
+{
+        // chunks are only decompressed when read
+}
+
+const backend_t chunked_backend = {
+        "chunked", chunked_open, chunked_read, chunked_readv, chunked_write,
+        chunked_flush, chunked_size, chunked_hint, chunked_close
+};
+
+static int is_zero(const char *buf, size_t len)
+{
+        for (size_t i = 0; i < len; i++) {
+                if (buf[i]) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+// write the image at src as a chunked file dst, which must not exist yet.
+// Returns the number of chunks.
+int chunked_convert(const char *src, const char *dst, unsigned int chunk_size)
+{
+        int in = open(src, O_RDONLY);
+        if (in < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", src);
+        }
+        struct stat st;
+        if (fstat(in, &st) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", src);
+        }
+        int out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (out < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", dst);
+        }
+
+        chunked_header_t h;
+        memset(&h, 0, sizeof(h));
+        memcpy(h.magic, CHUNKED_MAGIC, sizeof(h.magic));
+        h.version = CHUNKED_VERSION;
+        h.chunk_size = chunk_size;
+        h.image_size = st.st_size;
+        h.chunk_count = (h.image_size + chunk_size - 1) / chunk_size;
+
+        uint64_t *offsets = malloc((h.chunk_count + 1) * sizeof(uint64_t));
+        char *raw = malloc(chunk_size);
+        uLong bound = compressBound(chunk_size);
+        char *packed = malloc(bound);
+        if (!offsets || !raw || !packed) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        uint64_t offset = sizeof(h);
+        for (uint64_t c = 0; c < h.chunk_count; c++) {
+                size_t length = h.image_size - c * chunk_size;
+                if (length > chunk_size) {
+                        length = chunk_size;
+                }
+                if (pread(in, raw, length, c * chunk_size) != length) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, "%s", src);
+                }
+                offsets[c] = offset;
+                if (is_zero(raw, length)) {
+                        continue;
+                }
+                uLongf packed_len = bound;
+                const char *from = packed;
+                if (compress2((Bytef *)packed, &packed_len, (Bytef *)raw, length, Z_DEFAULT_COMPRESSION) != Z_OK
+                    || packed_len >= length) {
+                        // not worth it, keep the data as it is
+                        from = raw;
+                        packed_len = length;
+                }
+                if (pwrite(out, from, packed_len, offset) != packed_len) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, "%s", dst);
+                }
+                offset += packed_len;
+        }
+        offsets[h.chunk_count] = offset;
+
+        h.index_offset = offset;
+        size_t index_bytes = (h.chunk_count + 1) * sizeof(uint64_t);
+        if (pwrite(out, offsets, index_bytes, offset) != index_bytes
+            || pwrite(out, &h, sizeof(h), 0) != sizeof(h)
+            || fsync(out) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", dst);
+        }
+
+        free(packed);
+        free(raw);
+        free(offsets);
+        close(out);
+        close(in);
+
+        return h.chunk_count;
+}
+
+#ifdef CHUNKCONVERT
+
+// mkchunked [-c chunk size] image archive
+int main(int argc, char **argv)
+{
+        unsigned int chunk_size = CHUNKED_DEFAULT_CHUNK_SIZE;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "c:")) != -1) {
+                switch (opt) {
+                case 'c':
+                        chunk_size = strtoul(optarg, NULL, 0);
+                        if (chunk_size == 0 || chunk_size % sector_size_bytes != 0
+                            || chunk_size > CHUNKED_MAX_CHUNK_SIZE) {
+                                printf("chunk size must be a multiple of %u up to %u\n",
+                                       sector_size_bytes, CHUNKED_MAX_CHUNK_SIZE);
+                                return -1;
+                        }
+                        break;
+                default:
+                        printf("usage: %s [-c chunk size] image archive\n", argv[0]);
+                        return -1;
+                }
+        }
+        if (argc - optind != 2) {
+                printf("usage: %s [-c chunk size] image archive\n", argv[0]);
+                return -1;
+        }
+
+        int chunks = chunked_convert(argv[optind], argv[optind + 1], chunk_size);
+        struct stat in, out;
+        stat(argv[optind], &in);
+        stat(argv[optind + 1], &out);
+        printf("%s: %d chunks of %u bytes, %lld bytes to %lld\n", argv[optind + 1],
+               chunks, chunk_size, (long long)in.st_size, (long long)out.st_size);
+
+        return 0;
+}
+
+const unsigned int sector_size_bytes = 512;
+
+#endif
@@ -0,0 +1,97 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "clone.h"
+
+// bytes moved by one read and write when the kernel cannot copy
+#define COPY_BUFFER_SIZE (1 << 20)
+
+// copy len bytes at offset, in the kernel when it can do it
+static void copy_range(int in, int out, off_t offset, off_t len)
+{
+        char *buf = NULL;
+
+        while (len > 0) {
+                loff_t in_off = offset, out_off = offset;
+                ssize_t n = -1;
+                if (!buf) {
+                        n = copy_file_range(in, &in_off, out, &out_off, len, 0);
+                        if (n < 0 && errno != EXDEV && errno != ENOSYS && errno != EOPNOTSUPP && errno != EINVAL) {
+                                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                        }
+                }
+                if (n <= 0) {
+                        // the kernel cannot copy between these files
+                        if (!buf && !(buf = malloc(COPY_BUFFER_SIZE))) {
+                                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                        }
+                        n = pread(in, buf, len < COPY_BUFFER_SIZE ? len : COPY_BUFFER_SIZE, offset);
+                        if (n <= 0 || pwrite(out, buf, n, offset) != n) {
+                                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                        }
+                }
+                offset += n;
+                len -= n;
+        }
+        free(buf);
+}
+
+// clone src into a new file dst, sharing its blocks when the file system
+// supports reflinks, else copying the data ranges only so the holes of
+// src stay holes. Returns CLONE_REFLINK or CLONE_SPARSE_COPY.
+int clone_image(const char *src, const char *dst)
+{
+        int in = open(src, O_RDONLY);
+        if (in < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", src);
+        }
+        struct stat st;
+        if (fstat(in, &st) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", src);
+        }
+        // never write over an existing file. The clone is the owner's to
+        // repair, whether the source was read-only or open to others
+        int out = open(dst, O_WRONLY | O_CREAT | O_EXCL, 0600);
+        if (out < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", dst);
+        }
+
+        int method = CLONE_REFLINK;
+        if (ioctl(out, FICLONE, in) < 0) {
+                method = CLONE_SPARSE_COPY;
+                if (ftruncate(out, st.st_size) < 0) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, "%s", dst);
+                }
+
+                off_t data = 0;
+                while ((data = lseek(in, data, SEEK_DATA)) >= 0) {
+                        off_t hole = lseek(in, data, SEEK_HOLE);
+                        if (hole < 0) {
+                                hole = st.st_size;
+                        }
+                        copy_range(in, out, data, hole - data);
+                        data = hole;
+                }
+                if (errno != ENXIO) {
+                        // no hole information, copy everything
+                        copy_range(in, out, 0, st.st_size);
+                }
+        }
+
+        if (fsync(out) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", dst);
+        }
+        close(out);
+        close(in);
+
+        return method;
+}
@@ -0,0 +1,181 @@
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+
+static uint32_t name_hash(const char *name, int name_len)
+{
+        // FNV-1a
+        uint32_t hash = 2166136261u;
+        for (int i = 0; i < name_len; i++) {
+                hash ^= (unsigned char)name[i];
+                hash *= 16777619u;
+        }
+        return hash;
+}
+
+static inline int bucket_of(dcache_t *dc, int parent, uint32_t hash)
+{
+        return (hash ^ ((uint32_t)parent * 2654435761u)) & (dc->bucket_count - 1);
+}
+
+static inline uint32_t *gen_of(dcache_t *dc, int parent)
+{
+        return &dc->gens[((uint32_t)parent * 2654435761u) & (dc->bucket_count - 1)];
+}
+
+dcache_t *dcache_new(int cap)
+{
+        dcache_t *dc = malloc(sizeof(dcache_t));
+        if (!dc) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        // a power of two near the capacity
+        dc->bucket_count = 1;
+        while (dc->bucket_count < cap) {
+                dc->bucket_count <<= 1;
+        }
+        dc->buckets = calloc(dc->bucket_count, sizeof(dentry_t *));
+        dc->gens = calloc(dc->bucket_count, sizeof(uint32_t));
+        if (!dc->buckets || !dc->gens) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        dc->len = 0;
+        dc->cap = cap;
+        pthread_mutex_init(&dc->lock, NULL);
+
+        return dc;
+}
+
+static void drop_all(dcache_t *dc)
+{
+        for (int i = 0; i < dc->bucket_count; i++) {
+                dentry_t *d = dc->buckets[i];
+                while (d) {
+                        dentry_t *next = d->next;
+                        free(d);
+                        d = next;
+                }
+                dc->buckets[i] = NULL;
+        }
+        dc->len = 0;
+}
+
+static dentry_t *find_entry(dcache_t *dc, int parent, uint32_t hash, const char *name, int name_len)
+{
+        for (dentry_t *d = dc->buckets[bucket_of(dc, parent, hash)]; d; d = d->next) {
+                if (d->parent == parent && d->hash == hash && d->name_len == name_len
+                    && memcmp(d->name, name, name_len) == 0) {
+                        // stale entries are left for put_entry() to refresh
+                        return d;
+                }
+        }
+        return NULL;
+}
+
+// find the entry of name in parent, returns its inode, 0 when the name is
+// known to be absent and DCACHE_MISS when it is not cached
+int dcache_lookup(dcache_t *dc, int parent, const char *name, int name_len,
+                  struct ext2_dir_entry_2 *ret)
+{
+        if (!dc) {
+                return DCACHE_MISS;
+        }
+
+        int inode = DCACHE_MISS;
+        uint32_t hash = name_hash(name, name_len);
+
+        pthread_mutex_lock(&dc->lock);
+        dentry_t *d = find_entry(dc, parent, hash, name, name_len);
+        if (d && d->gen == *gen_of(dc, parent)) {
+                inode = d->inode;
+                if (inode != 0 && ret) {
+                        ret->inode = d->inode;
+                        ret->rec_len = d->rec_len;
+                        ret->name_len = d->name_len;
+                        ret->file_type = d->file_type;
+                        memcpy(ret->name, d->name, d->name_len);
+                }
+        }
+        pthread_mutex_unlock(&dc->lock);
+
+        return inode;
+}
+
+static void put_entry(dcache_t *dc, int parent, const char *name, int name_len,
+                      int inode, int rec_len, int file_type)
+{
+        uint32_t hash = name_hash(name, name_len);
+
+        pthread_mutex_lock(&dc->lock);
+        dentry_t *d = find_entry(dc, parent, hash, name, name_len);
+        if (!d) {
+                if (dc->len >= dc->cap) {
+                        drop_all(dc);
+                }
+                d = malloc(sizeof(dentry_t) + name_len);
+                if (!d) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                d->parent = parent;
+                d->hash = hash;
+                d->name_len = name_len;
+                memcpy(d->name, name, name_len);
+
+                int b = bucket_of(dc, parent, hash);
+                d->next = dc->buckets[b];
+                dc->buckets[b] = d;
+                dc->len++;
+        }
+        d->inode = inode;
+        d->rec_len = rec_len;
+        d->file_type = file_type;
+        d->gen = *gen_of(dc, parent);
+        pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_insert(dcache_t *dc, int parent, struct ext2_dir_entry_2 *dir)
+{
+        if (!dc || dir->inode == 0) {
+                return;
+        }
+        put_entry(dc, parent, dir->name, dir->name_len, dir->inode, dir->rec_len, dir->file_type);
+}
+
+// remember that parent has no entry called name
+void dcache_insert_negative(dcache_t *dc, int parent, const char *name, int name_len)
+{
+        if (!dc) {
+                return;
+        }
+        put_entry(dc, parent, name, name_len, 0, 0, 0);
+}
+
+// forget every entry of a directory, called whenever one of its blocks is
+// written. Its entries turn stale at once and are refreshed when cached again.
+void dcache_invalidate(dcache_t *dc, int parent)
+{
+        if (!dc) {
+                return;
+        }
+
+        pthread_mutex_lock(&dc->lock);
+        (*gen_of(dc, parent))++;
+        pthread_mutex_unlock(&dc->lock);
+}
+
+void dcache_delete(dcache_t *dc)
+{
+        if (!dc) {
+                return;
+        }
+        drop_all(dc);
+        free(dc->buckets);
+        free(dc->gens);
+        pthread_mutex_destroy(&dc->lock);
+        free(dc);
+}
@@ -8,8 +8,10 @@
 
 #include "disk.h"
 #include "genhd.h"
+#include "overlay.h"
 #include "readwrite.h"
 #include "read_partition.h"
+#include "spill.h"
 #include "util/partition.h"
 
 #define NEW_INSTANCE(ret, structure)                                    \
@@ -19,8 +21,14 @@
 
 #define IS_EXT2_PARTITION(partition) ((partition)->partition_info->sys_ind == 0x83)
 
+// directory entries cached per partition
+#define DCACHE_SIZE 65536
+
 extern const unsigned int sector_size_bytes;
 extern int device;
+extern long long max_memory;
+extern int read_only;
+extern const char *io_backend;
 
 const unsigned int super_block_offset = 1024;
 const unsigned int group_desc_block_offset = 2;
@@ -58,42 +66,210 @@ static int load_partitions(disk_t *disk)
 
                 // partition index starts from 1
                 disk->partitions[i]->id = i+1;
+
+                // groups are loaded later, for ext2 partitions only
+                disk->partitions[i]->super_block = NULL;
+                disk->partitions[i]->group_count = 0;
+                disk->partitions[i]->groups = NULL;
+                disk->partitions[i]->descs = NULL;
+                disk->partitions[i]->bitmaps = NULL;
+                disk->partitions[i]->bitmaps_dirty = NULL;
+                disk->partitions[i]->window = NULL;
+                disk->partitions[i]->dcache = NULL;
         }
 
         return 0;
 }
 
+// number of blocks holding the inode table of a group
+static int get_inode_table_blocks(partition_t *pt)
+{
+        return (get_inodes_per_group(pt) * sizeof(struct ext2_inode) + (get_block_size(pt) - 1)) /  get_block_size(pt);
+}
+
+// the in-memory table is the only copy repairs change, inode_table points
+// into the blocks as read so a flush writes them back as they are
 static int load_inode_table(partition_t *pt, int group_id)
 {
         group_t * g = pt->groups[group_id];
 
-        g->entry_count = get_inodes_per_group(pt) - get_free_inodes_count(g);
         g->inode_table = malloc(sizeof(struct ext2_inode *) * get_inodes_per_group(pt));
-        if (!g->inode_table) {
+        g->inode_dirty = calloc(get_inode_table_blocks(pt) * get_block_size(pt) / sector_size_bytes, sizeof(char));
+        if (!g->inode_table || !g->inode_dirty) {
                 error_at_line(-1, errno, __FILE__, __LINE__, NULL);
         }
 
-        int block_count = (get_inodes_per_group(pt) * sizeof(struct ext2_inode) + (get_block_size(pt) - 1)) /  get_block_size(pt);
-        char *table = read_block(pt, get_inode_table_bid(g), block_count);
-
+        // a table in a hole of the image is zeroed by the backend without
+        // any I/O, and still gets the planned and overlaid sectors
+        g->inode_blocks = read_block(pt, get_inode_table_bid(g), get_inode_table_blocks(pt));
         for (int i = 0; i < get_inodes_per_group(pt); i++) {
-                NEW_INSTANCE(g->inode_table[i], struct ext2_inode);
-                memcpy(g->inode_table[i], table+i*sizeof(struct ext2_inode), sizeof(struct ext2_inode));
+                g->inode_table[i] = (struct ext2_inode *)(g->inode_blocks + i*sizeof(struct ext2_inode));
         }
-        free(table);
 
         return 0;
 }
 
-static int load_groups(partition_t *pt)
+// write the dirty sectors of a loaded table
+static int flush_inode_table(partition_t *pt, int group_id)
+{
+        group_t *g = pt->groups[group_id];
+
+        if (!g->inode_table) {
+                return 0;
+        }
+        return write_dirty_sectors(pt, get_inode_table_bid(g), get_inode_table_blocks(pt),
+                                   g->inode_blocks, g->inode_dirty);
+}
+
+int flush_inode_tables(partition_t *pt)
+{
+        for (int i = 0; i < pt->group_count; i++) {
+                flush_inode_table(pt, i);
+        }
+
+        return 0;
+}
+
+// write the dirty sectors of every block bitmap, returns how many groups
+// had any
+int flush_block_bitmaps(partition_t *pt)
+{
+        int sectors_per_block = get_block_size(pt) / sector_size_bytes;
+        int flushed = 0;
+
+        for (int i = 0; i < pt->group_count; i++) {
+                group_t *g = pt->groups[i];
+                if (memchr(g->bitmap_dirty, 1, sectors_per_block) == NULL) {
+                        continue;
+                }
+                write_dirty_sectors(pt, get_block_bitmap_bid(g), 1, g->block_bitmap, g->bitmap_dirty);
+                flushed++;
+        }
+
+        return flushed;
+}
+
+static int unload_inode_table(partition_t *pt, int group_id)
+{
+        group_t *g = pt->groups[group_id];
+
+        if (!g->inode_table) {
+                return 0;
+        }
+        flush_inode_table(pt, group_id);
+        free(g->inode_blocks);
+        free(g->inode_dirty);
+        free(g->inode_table);
+        g->inode_table = NULL;
+
+        return 0;
+}
+
+// size the inode table window from the memory budget, half of it goes to
+// the tables and the rest is left to the checker's own state
+static int set_inode_window(partition_t *pt)
+{
+        pt->window_size = 0;
+        pt->window = NULL;
+        pt->window_hand = 0;
+        pt->window_last = -1;
+
+        if (max_memory == 0) {
+                return 0;
+        }
+
+        long long table_bytes = (long long)get_inodes_per_group(pt) *
+                (sizeof(struct ext2_inode) + sizeof(struct ext2_inode *));
+        long long size = max_memory / 2 / table_bytes;
+        if (size < 2) {
+                size = 2;
+        }
+        if (size >= pt->group_count) {
+                return 0; // every table fits
+        }
+
+        pt->window_size = size;
+        pt->window = malloc(sizeof(int) * size);
+        if (!pt->window) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        for (int i = 0; i < size; i++) {
+                pt->window[i] = -1;
+        }
+
+        return 0;
+}
+
+// load a table into the window, the clock hand evicts the first group not
+// used since it last passed, sparing the group used most recently and the
+// pinned ones. When every group is spared the window grows by a slot.
+static int window_insert(partition_t *pt, int group_id)
 {
-        char buf[sector_size_bytes];
+        for (int step = 0;; step++) {
+                if (step == 2 * pt->window_size) {
+                        pt->window = realloc(pt->window, sizeof(int) * (pt->window_size + 1));
+                        if (!pt->window) {
+                                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                        }
+                        pt->window_hand = pt->window_size++;
+                        break;
+                }
+                int victim = pt->window[pt->window_hand];
+                if (victim < 0) {
+                        break;
+                }
+                group_t *v = pt->groups[victim];
+                if (victim != pt->window_last && !v->referenced && v->pins == 0) {
+                        unload_inode_table(pt, victim);
+                        break;
+                }
+                v->referenced = 0;
+                pt->window_hand = (pt->window_hand + 1) % pt->window_size;
+        }
+
+        pt->window[pt->window_hand] = group_id;
+        pt->window_hand = (pt->window_hand + 1) % pt->window_size;
+
+        return load_inode_table(pt, group_id);
+}
+
+// the inode table of a group, read in first when it is out of the window.
+// With a window an entry stays valid until tables of two other groups are
+// read, pin_inode_entry() keeps one for longer.
+struct ext2_inode ** get_inode_table(partition_t *pt, int group_id)
+{
+        group_t *g = pt->groups[group_id];
 
+        if (pt->window_size == 0) {
+                return g->inode_table;
+        }
+        if (!g->inode_table) {
+                window_insert(pt, group_id);
+                // scans go group by group, have the next table read meanwhile
+                if (group_id + 1 < pt->group_count) {
+                        hint_blocks(pt, get_inode_table_bid(pt->groups[group_id + 1]),
+                                    get_inode_table_blocks(pt), IO_HINT_WILLNEED);
+                }
+        }
+        g->referenced = 1;
+        pt->window_last = group_id;
+
+        return g->inode_table;
+}
+
+// number of blocks holding the group descriptor table
+static int get_group_desc_blocks(partition_t *pt)
+{
+        int table_size = sizeof(struct ext2_group_desc) * pt->group_count;
+        return (table_size + get_block_size(pt) - 1) / get_block_size(pt);
+}
+
+static int load_groups(partition_t *pt)
+{
         // load superblock
         NEW_INSTANCE(pt->super_block, struct ext2_super_block);
         int offset = pt->base_sector + pt->partition_info->start_sect + (super_block_offset / sector_size_bytes);
-        read_sectors(offset, 1, buf);
-        memcpy(pt->super_block, buf, sizeof(struct ext2_super_block));
+        read_sectors(offset, sizeof(struct ext2_super_block) / sector_size_bytes, pt->super_block);
 
         // make the group array
         pt->group_count = get_number_of_groups(pt);
@@ -102,37 +278,93 @@ static int load_groups(partition_t *pt)
                 error_at_line(-1, errno, __FILE__, __LINE__, NULL);
         }
 
-        char *group_desc_table = read_block(pt, group_desc_block_offset, 1); // read group descriptor table
+        char *group_desc_table = read_block(pt, group_desc_block_offset, get_group_desc_blocks(pt)); // read group descriptor table
+
+        set_inode_window(pt);
+        pt->dcache = dcache_new(DCACHE_SIZE);
+
+        // descriptors and bitmaps grow with the file system, they count
+        // against the memory budget
+        int block_size = get_block_size(pt);
+        int sectors_per_block = block_size / sector_size_bytes;
+        pt->descs = spill_calloc(pt->group_count, sizeof(struct ext2_group_desc));
+        pt->bitmaps = spill_calloc(pt->group_count * 2, block_size);
+        pt->bitmaps_dirty = spill_calloc(pt->group_count, sectors_per_block);
+        memcpy(pt->descs, group_desc_table, sizeof(struct ext2_group_desc) * pt->group_count);
 
         // load group descriptor and data for each group
         for (int i = 0; i < pt->group_count; i++) {
                 NEW_INSTANCE(pt->groups[i], group_t);
-                NEW_INSTANCE(pt->groups[i]->desc, struct ext2_group_desc);
-                memcpy(pt->groups[i]->desc,
-                       group_desc_table+(sizeof(struct ext2_group_desc)*i),
-                       sizeof(struct ext2_group_desc));
+                pt->groups[i]->desc = &pt->descs[i];
 
                 // group's index starts from 0
                 pt->groups[i]->id = i;
 
-                // get bitmaps
-                pt->groups[i]->block_bitmap = read_block(pt, get_block_bitmap_bid(pt->groups[i]), 1);
-                pt->groups[i]->inode_bitmap = read_block(pt, get_inode_bitmap_bid(pt->groups[i]), 1);
+                // get bitmaps, in one request as they are usually next to each other
+                pt->groups[i]->block_bitmap = pt->bitmaps + (long)block_size * 2 * i;
+                pt->groups[i]->inode_bitmap = pt->bitmaps + (long)block_size * (2 * i + 1);
+                sector_run_t bitmaps[2] = {
+                        {get_block_sector(pt, get_block_bitmap_bid(pt->groups[i])),
+                         block_size / sector_size_bytes, pt->groups[i]->block_bitmap},
+                        {get_block_sector(pt, get_inode_bitmap_bid(pt->groups[i])),
+                         block_size / sector_size_bytes, pt->groups[i]->inode_bitmap},
+                };
+                read_sectors_v(bitmaps, 2);
+                pt->groups[i]->bitmap_dirty = pt->bitmaps_dirty + sectors_per_block * i;
+
+                pt->groups[i]->entry_count = get_inodes_per_group(pt) - get_free_inodes_count(pt->groups[i]);
+                pt->groups[i]->referenced = 0;
+                pt->groups[i]->pins = 0;
+
+                // get inode table, or leave it to the window
+                pt->groups[i]->inode_table = NULL;
+                if (pt->window_size == 0) {
+                        load_inode_table(pt, i);
+                }
+        }
+        free(group_desc_table);
+
+        return 0;
+}
 
-                // get inode table
-                load_inode_table(pt, i);
+// write the in-memory group descriptors back with one table write
+int write_group_desc_table(partition_t *pt)
+{
+        int block_count = get_group_desc_blocks(pt);
+        char *group_desc_table = read_block(pt, group_desc_block_offset, block_count);
+
+        for (int i = 0; i < pt->group_count; i++) {
+                memcpy(group_desc_table+(sizeof(struct ext2_group_desc)*i),
+                       pt->groups[i]->desc,
+                       sizeof(struct ext2_group_desc));
         }
+        write_block(pt, group_desc_block_offset, block_count, group_desc_table);
         free(group_desc_table);
 
         return 0;
 }
 
+// write the in-memory superblock back
+int write_super_block(partition_t *pt)
+{
+        int offset = pt->base_sector + pt->partition_info->start_sect + (super_block_offset / sector_size_bytes);
+        write_sectors(offset, sizeof(struct ext2_super_block) / sector_size_bytes, pt->super_block);
+
+        return 0;
+}
+
 int open_disk(char *path, disk_t *disk, int fix_partition)
 {
-        device = open(path, O_RDWR);
+        device = open(path, read_only ? O_RDONLY : O_RDWR);
         if (device < 0) {
                 error_at_line(-1, errno, __FILE__, __LINE__, NULL);
         }
+        if (open_backend(io_backend, device) < 0) {
+                error_at_line(-1, 0, __FILE__, __LINE__, "the %s backend cannot open %s", io_backend, path);
+        }
+        if (overlay_active()) {
+                stack_overlay_backend();
+        }
 
         load_partitions(disk);
 
@@ -152,29 +384,33 @@ int open_disk(char *path, disk_t *disk, int fix_partition)
 
 int free_disk(disk_t *disk)
 {
-        close(device);
         for (int i = 0; i < disk->partition_count; i++) {
                 partition_t *pt = disk->partitions[i];
-                free(pt->partition_info);
-                free(pt->super_block);
-
+                // flushing the tables still reads the superblock and
+                // where the partition starts
                 for (int j = 0; j < pt->group_count; j++) {
-                        group_t *g = pt->groups[j];
-                        free(g->desc);
-                        free(g->block_bitmap);
-                        free(g->inode_bitmap);
-
-                        for (int k = 0; k < g->entry_count; k++) {
-                                free(g->inode_table[k]);
-                        }
-                        free(g->inode_table);
-                        free(g);
+                        unload_inode_table(pt, j);
+                        free(pt->groups[j]);
+                }
+                if (pt->group_count > 0) {
+                        int block_size = get_block_size(pt);
+                        spill_free(pt->descs, sizeof(struct ext2_group_desc) * pt->group_count);
+                        spill_free(pt->bitmaps, (size_t)block_size * 2 * pt->group_count);
+                        spill_free(pt->bitmaps_dirty, block_size / sector_size_bytes * pt->group_count);
                 }
                 free(pt->groups);
+                free(pt->super_block);
+                free(pt->partition_info);
+                free(pt->window);
+                dcache_delete(pt->dcache);
                 free(pt);
         }
         free(disk->partitions);
 
+        flush_sectors();
+        close_backend();
+        close(device);
+
         return 0;
 }
 
@@ -0,0 +1,430 @@
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dcache.h"
+#include "htree.h"
+#include "util/partition.h"
+
+// the index sits after the '.' and '..' entries of the first block, and
+// after an empty entry spanning the block in interior nodes
+#define DX_ROOT_INFO_OFFSET 24
+#define DX_NODE_OFFSET 8
+
+// deepest tree a directory may have, with the largedir feature
+#define DX_MAX_LEVELS 3
+
+#define MIN(a, b) (a) < (b) ? (a) : (b)
+
+struct dx_root_info {
+        __u32 reserved_zero;
+        __u8 hash_version;
+        __u8 info_length;
+        __u8 indirect_levels;
+        __u8 unused_flags;
+};
+
+// the first entry of a node keeps limit and count where the hash would be
+struct dx_countlimit {
+        __u16 limit;
+        __u16 count;
+};
+
+struct dx_entry {
+        __u32 hash;
+        __u32 block;
+};
+
+/*
+ * The hash functions below follow the ext2 ones, see dirhash.c in e2fsprogs.
+ */
+
+// F, G and H are the basic MD4 functions: selection, majority, parity
+#define F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define H(x, y, z) ((x) ^ (y) ^ (z))
+
+#define ROUND(f, a, b, c, d, x, s) \
+        (a += f(b, c, d) + x, a = (a << s) | (a >> (32 - s)))
+#define K1 0
+#define K2 013240474631UL
+#define K3 015666365641UL
+
+static void half_md4_transform(__u32 buf[4], const __u32 in[8])
+{
+        __u32 a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+        // round 1
+        ROUND(F, a, b, c, d, in[0] + K1,  3);
+        ROUND(F, d, a, b, c, in[1] + K1,  7);
+        ROUND(F, c, d, a, b, in[2] + K1, 11);
+        ROUND(F, b, c, d, a, in[3] + K1, 19);
+        ROUND(F, a, b, c, d, in[4] + K1,  3);
+        ROUND(F, d, a, b, c, in[5] + K1,  7);
+        ROUND(F, c, d, a, b, in[6] + K1, 11);
+        ROUND(F, b, c, d, a, in[7] + K1, 19);
+
+        // round 2
+        ROUND(G, a, b, c, d, in[1] + K2,  3);
+        ROUND(G, d, a, b, c, in[3] + K2,  5);
+        ROUND(G, c, d, a, b, in[5] + K2,  9);
+        ROUND(G, b, c, d, a, in[7] + K2, 13);
+        ROUND(G, a, b, c, d, in[0] + K2,  3);
+        ROUND(G, d, a, b, c, in[2] + K2,  5);
+        ROUND(G, c, d, a, b, in[4] + K2,  9);
+        ROUND(G, b, c, d, a, in[6] + K2, 13);
+
+        // round 3
+        ROUND(H, a, b, c, d, in[3] + K3,  3);
+        ROUND(H, d, a, b, c, in[7] + K3,  9);
+        ROUND(H, c, d, a, b, in[2] + K3, 11);
+        ROUND(H, b, c, d, a, in[6] + K3, 15);
+        ROUND(H, a, b, c, d, in[1] + K3,  3);
+        ROUND(H, d, a, b, c, in[5] + K3,  9);
+        ROUND(H, c, d, a, b, in[0] + K3, 11);
+        ROUND(H, b, c, d, a, in[4] + K3, 15);
+
+        buf[0] += a;
+        buf[1] += b;
+        buf[2] += c;
+        buf[3] += d;
+}
+
+static void tea_transform(__u32 buf[4], const __u32 in[4])
+{
+        __u32 sum = 0;
+        __u32 b0 = buf[0], b1 = buf[1];
+        __u32 a = in[0], b = in[1], c = in[2], d = in[3];
+
+        for (int n = 0; n < 16; n++) {
+                sum += 0x9E3779B9;
+                b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+                b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+        }
+
+        buf[0] += b0;
+        buf[1] += b1;
+}
+
+static __u32 dx_hack_hash(const char *name, int len, int unsigned_flag)
+{
+        __u32 hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+        for (int i = 0; i < len; i++) {
+                int c = unsigned_flag ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+                hash = hash1 + (hash0 ^ (c * 7152373));
+                if (hash & 0x80000000) {
+                        hash -= 0x7fffffff;
+                }
+                hash1 = hash0;
+                hash0 = hash;
+        }
+        return hash0 << 1;
+}
+
+// pack up to num words of the name, padded with its length
+static void str2hashbuf(const char *msg, int len, __u32 *buf, int num, int unsigned_flag)
+{
+        __u32 pad, val;
+
+        pad = (__u32)len | ((__u32)len << 8);
+        pad |= pad << 16;
+
+        val = pad;
+        if (len > num * 4) {
+                len = num * 4;
+        }
+        for (int i = 0; i < len; i++) {
+                int c = unsigned_flag ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+                val = c + (val << 8);
+                if ((i % 4) == 3) {
+                        *buf++ = val;
+                        val = pad;
+                        num--;
+                }
+        }
+        if (--num >= 0) {
+                *buf++ = val;
+        }
+        while (--num >= 0) {
+                *buf++ = pad;
+        }
+}
+
+// hash a name the way the kernel orders an indexed directory, -1 for an
+// unknown version
+int ext2_dirhash(int version, const char *name, int len, const __u32 *seed, __u32 *ret_hash)
+{
+        __u32 hash;
+        __u32 in[8], buf[4];
+        int unsigned_flag = 0;
+
+        // the default seed, used when the superblock has none
+        buf[0] = 0x67452301;
+        buf[1] = 0xefcdab89;
+        buf[2] = 0x98badcfe;
+        buf[3] = 0x10325476;
+        if (seed && (seed[0] || seed[1] || seed[2] || seed[3])) {
+                memcpy(buf, seed, sizeof(buf));
+        }
+
+        switch (version) {
+        case DX_HASH_LEGACY_UNSIGNED:
+                unsigned_flag = 1;
+                // fall through
+        case DX_HASH_LEGACY:
+                hash = dx_hack_hash(name, len, unsigned_flag);
+                break;
+        case DX_HASH_HALF_MD4_UNSIGNED:
+                unsigned_flag = 1;
+                // fall through
+        case DX_HASH_HALF_MD4:
+                for (const char *p = name; len > 0; len -= 32, p += 32) {
+                        str2hashbuf(p, len, in, 8, unsigned_flag);
+                        half_md4_transform(buf, in);
+                }
+                hash = buf[1];
+                break;
+        case DX_HASH_TEA_UNSIGNED:
+                unsigned_flag = 1;
+                // fall through
+        case DX_HASH_TEA:
+                for (const char *p = name; len > 0; len -= 16, p += 16) {
+                        str2hashbuf(p, len, in, 4, unsigned_flag);
+                        tea_transform(buf, in);
+                }
+                hash = buf[0];
+                break;
+        default:
+                *ret_hash = 0;
+                return -1;
+        }
+
+        *ret_hash = hash & ~1;
+        return 0;
+}
+
+// scan one leaf block for name, caching the entries passed on the way
+static int scan_leaf(partition_t *pt, int dir_inode, int block_id, const char *name,
+                     int name_len, struct ext2_dir_entry_2 *ret)
+{
+        int block_size = get_block_size(pt);
+        char *block = read_block(pt, block_id, 1);
+        struct ext2_dir_entry_2 dir;
+        int child_inode = 0;
+
+        for (int offset = 0; offset + 8 <= block_size; offset += dir.rec_len) {
+                memcpy(&dir, block+offset, MIN(sizeof(dir), block_size - offset));
+                if (dir.rec_len < 8 || offset + dir.rec_len > block_size) {
+                        break;
+                }
+                if (dir.inode == 0) {
+                        continue;
+                }
+                dcache_insert(pt->dcache, dir_inode, &dir);
+                if (dir.name_len == name_len && memcmp(dir.name, name, name_len) == 0) {
+                        child_inode = dir.inode;
+                        if (ret) {
+                                memcpy(ret, &dir, sizeof(dir));
+                        }
+                        break;
+                }
+        }
+        free(block);
+
+        return child_inode;
+}
+
+// check the count and limit of a node whose entries start at offset
+static int valid_countlimit(struct dx_countlimit *cl, int block_size, int offset)
+{
+        int limit = (block_size - offset) / sizeof(struct dx_entry);
+        return cl->limit == limit && cl->count >= 1 && cl->count <= cl->limit;
+}
+
+// find name in a hash indexed directory through its interior nodes, in
+// O(log n) block reads. Returns the inode, 0 when the name is absent, and
+// HTREE_UNUSABLE when the directory has no usable index; the caller then
+// scans the leaf blocks linearly.
+int htree_find_child(partition_t *pt, int dir_inode, const char *name, int name_len,
+                     struct ext2_dir_entry_2 *ret)
+{
+        struct ext2_super_block *sb = pt->super_block;
+        struct ext2_inode *inode = get_inode_entry(pt, dir_inode);
+        int block_size = get_block_size(pt);
+
+        if (!(sb->s_feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX)
+            || inode == NULL || !(inode->i_flags & EXT2_INDEX_FL)) {
+                return HTREE_UNUSABLE;
+        }
+        // '.' and '..' live in the root block, ahead of the index
+        if ((name_len == 1 && name[0] == '.')
+            || (name_len == 2 && name[0] == '.' && name[1] == '.')) {
+                return HTREE_UNUSABLE;
+        }
+
+        int block_id = get_block_id(pt, dir_inode, 0);
+        if (block_id == 0) {
+                return HTREE_UNUSABLE;
+        }
+        char *node = read_block(pt, block_id, 1);
+
+        struct dx_root_info *info = (struct dx_root_info *)(node + DX_ROOT_INFO_OFFSET);
+        int version = info->hash_version;
+        int levels = info->indirect_levels;
+        int offset = DX_ROOT_INFO_OFFSET + info->info_length;
+        if (info->reserved_zero != 0 || info->info_length != sizeof(*info)
+            || version > DX_HASH_TEA || levels >= DX_MAX_LEVELS) {
+                free(node);
+                return HTREE_UNUSABLE;
+        }
+        if (sb->s_flags & EXT2_FLAGS_UNSIGNED_HASH) {
+                version += DX_HASH_LEGACY_UNSIGNED;
+        }
+
+        __u32 hash;
+        ext2_dirhash(version, name, name_len, sb->s_hash_seed, &hash);
+
+        // the hash of the interior entry following the path, the next node
+        // may hold colliding names when its low bit is set
+        __u32 next_hash = 0;
+        struct dx_entry *entries;
+        struct dx_countlimit *cl;
+        int i;
+
+        for (int level = 0; ; level++) {
+                cl = (struct dx_countlimit *)(node + offset);
+                entries = (struct dx_entry *)(node + offset);
+                if (!valid_countlimit(cl, block_size, offset)) {
+                        free(node);
+                        return HTREE_UNUSABLE;
+                }
+
+                // the last entry whose hash is not above ours, entry 0 has none
+                int lo = 1, hi = cl->count - 1;
+                while (lo <= hi) {
+                        int mid = (lo + hi) / 2;
+                        if (entries[mid].hash > hash) {
+                                hi = mid - 1;
+                        } else {
+                                lo = mid + 1;
+                        }
+                }
+                i = lo - 1;
+
+                if (level == levels) {
+                        break;
+                }
+                if (i + 1 < cl->count) {
+                        next_hash = entries[i + 1].hash;
+                }
+
+                block_id = get_block_id(pt, dir_inode, entries[i].block & 0x0fffffff);
+                free(node);
+                if (block_id == 0) {
+                        return HTREE_UNUSABLE;
+                }
+                node = read_block(pt, block_id, 1);
+                offset = DX_NODE_OFFSET;
+        }
+
+        // names with the same hash may continue into the following leaves
+        int child_inode = 0;
+        for (;;) {
+                block_id = get_block_id(pt, dir_inode, entries[i].block & 0x0fffffff);
+                if (block_id == 0) {
+                        child_inode = HTREE_UNUSABLE;
+                        break;
+                }
+                child_inode = scan_leaf(pt, dir_inode, block_id, name, name_len, ret);
+                if (child_inode != 0) {
+                        break;
+                }
+                if (i + 1 < cl->count) {
+                        __u32 h = entries[i + 1].hash;
+                        if ((h & 1) && (h & ~1) == hash) {
+                                i++;
+                                continue;
+                        }
+                } else if ((next_hash & 1) && (next_hash & ~1) == hash) {
+                        // the run goes on in the next interior node
+                        child_inode = HTREE_UNUSABLE;
+                }
+                break;
+        }
+        free(node);
+
+        return child_inode;
+}
+
+#ifdef TESTHTREE
+
+long long max_memory = 0;
+int read_only = 1;
+const char *io_backend = "pread";
+
+// look every name of an indexed directory up through the index and
+// compare with the linear scan, then look up names that are absent.
+// Build an image for it with e2fsck -fD on a dir_index file system.
+int main(int argc, char *argv[])
+{
+        disk_t disk;
+
+        if (argc < 3) {
+                printf("usage: %s <disk image> <directory inode> [partition number]\n", argv[0]);
+                return -1;
+        }
+        int dir_inode = atoi(argv[2]);
+        int partition = argc > 3 ? atoi(argv[3]) : 1;
+
+        open_disk(argv[1], &disk, 1);
+        if (partition < 1 || partition > disk.partition_count
+            || !is_ext2_partition(disk.partitions[partition-1])) {
+                printf("no ext2 partition %d\n", partition);
+                return -1;
+        }
+        partition_t *pt = disk.partitions[partition-1];
+
+        struct ext2_dir_entry_2 dir, found;
+        char name[EXT2_NAME_LEN + 1];
+        int checked = 0, wrong = 0;
+
+        slice_t *s = get_child_dirs(pt, dir_inode);
+        for (int i = 2; i < s->len; i++) {
+                get(s, i, &dir);
+                int inode = htree_find_child(pt, dir_inode, dir.name, dir.name_len, &found);
+                if (inode == HTREE_UNUSABLE) {
+                        printf("directory %d has no usable index\n", dir_inode);
+                        return 1;
+                }
+                if (inode != dir.inode) {
+                        printf("%.*s: index %d, scan %d\n", dir.name_len, dir.name, inode, dir.inode);
+                        wrong++;
+                }
+                checked++;
+        }
+        delete_slice(s);
+
+        for (int i = 0; i < 100; i++) {
+                snprintf(name, sizeof(name), "absent-%d", i);
+                int inode = htree_find_child(pt, dir_inode, name, strlen(name), &found);
+                if (inode == HTREE_UNUSABLE) {
+                        printf("directory %d has no usable index\n", dir_inode);
+                        return 1;
+                }
+                if (inode != 0) {
+                        printf("%s: index %d, expected none\n", name, inode);
+                        wrong++;
+                }
+                checked++;
+        }
+
+        printf("%d names looked up through the index, %d wrong\n", checked, wrong);
+        free_disk(&disk);
+
+        return wrong != 0;
+}
+
+#endif
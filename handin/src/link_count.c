@@ -0,0 +1,190 @@
+#include <errno.h>
+#include <error.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "link_count.h"
+#include "spill.h"
+
+#define NEW_INSTANCE(ret, structure)                                    \
+        if (((ret) = malloc(sizeof(structure))) == NULL) {              \
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);     \
+        }
+
+link_count_t *lc_new(int group_count, int inodes_per_group)
+{
+        link_count_t *lc;
+        NEW_INSTANCE(lc, link_count_t);
+
+        lc->group_count = group_count;
+        lc->inodes_per_group = inodes_per_group;
+        lc->groups = calloc(group_count, sizeof(uint16_t *));
+        lc->in_use = calloc(group_count, sizeof(char));
+        if (!lc->groups || !lc->in_use) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        lc->overflow_keys = NULL;
+        lc->overflow_counts = NULL;
+        lc->overflow_len = 0;
+        lc->overflow_cap = 0;
+
+        return lc;
+}
+
+// mark a group as holding inodes in use, so its counts get walked
+void lc_set_in_use(link_count_t *lc, int group_number)
+{
+        lc->in_use[group_number] = 1;
+}
+
+// test if a group holds inodes in use or any counted reference
+int lc_group_active(link_count_t *lc, int group_number)
+{
+        return lc->in_use[group_number] || lc->groups[group_number] != NULL;
+}
+
+static inline int overflow_slot(link_count_t *lc, int inode)
+{
+        int slot = (unsigned int)inode * 2654435761u % lc->overflow_cap;
+        while (lc->overflow_keys[slot] != 0 && lc->overflow_keys[slot] != inode) {
+                slot = (slot + 1) % lc->overflow_cap;
+        }
+        return slot;
+}
+
+static void overflow_grow(link_count_t *lc)
+{
+        int *keys = lc->overflow_keys;
+        int *counts = lc->overflow_counts;
+        int cap = lc->overflow_cap;
+
+        lc->overflow_cap = cap ? cap * 2 : 64;
+        lc->overflow_keys = calloc(lc->overflow_cap, sizeof(int));
+        lc->overflow_counts = calloc(lc->overflow_cap, sizeof(int));
+        if (!lc->overflow_keys || !lc->overflow_counts) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        for (int i = 0; i < cap; i++) {
+                if (keys[i] != 0) {
+                        int slot = overflow_slot(lc, keys[i]);
+                        lc->overflow_keys[slot] = keys[i];
+                        lc->overflow_counts[slot] = counts[i];
+                }
+        }
+        free(keys);
+        free(counts);
+}
+
+// add n references to an inode, inode numbers start from 1
+void lc_add(link_count_t *lc, int inode, int n)
+{
+        int group_number = (inode - 1) / lc->inodes_per_group;
+        int offset = (inode - 1) % lc->inodes_per_group;
+
+        uint16_t *counts = lc->groups[group_number];
+        if (!counts) {
+                counts = spill_calloc(lc->inodes_per_group, sizeof(uint16_t));
+                lc->groups[group_number] = counts;
+        }
+
+        if (counts[offset] != LINK_COUNT_SATURATED) {
+                if (counts[offset] + n < LINK_COUNT_SATURATED) {
+                        counts[offset] += n;
+                        return;
+                }
+                n += counts[offset];
+                counts[offset] = LINK_COUNT_SATURATED;
+        }
+
+        // saturated, keep the full count in the overflow map
+        if ((lc->overflow_len + 1) * 2 > lc->overflow_cap) {
+                overflow_grow(lc);
+        }
+        int slot = overflow_slot(lc, inode);
+        if (lc->overflow_keys[slot] == 0) {
+                lc->overflow_keys[slot] = inode;
+                lc->overflow_counts[slot] = 0;
+                lc->overflow_len++;
+        }
+        lc->overflow_counts[slot] += n;
+}
+
+int lc_get(link_count_t *lc, int inode)
+{
+        int group_number = (inode - 1) / lc->inodes_per_group;
+        int offset = (inode - 1) % lc->inodes_per_group;
+
+        uint16_t *counts = lc->groups[group_number];
+        if (!counts) {
+                return 0;
+        }
+        if (counts[offset] != LINK_COUNT_SATURATED) {
+                return counts[offset];
+        }
+        return lc->overflow_counts[overflow_slot(lc, inode)];
+}
+
+// drop every count, keeping the groups allocated
+void lc_reset(link_count_t *lc)
+{
+        for (int i = 0; i < lc->group_count; i++) {
+                if (lc->groups[i]) {
+                        memset(lc->groups[i], 0, lc->inodes_per_group * sizeof(uint16_t));
+                }
+        }
+        if (lc->overflow_cap) {
+                memset(lc->overflow_keys, 0, lc->overflow_cap * sizeof(int));
+        }
+        lc->overflow_len = 0;
+}
+
+void lc_delete(link_count_t *lc)
+{
+        for (int i = 0; i < lc->group_count; i++) {
+                spill_free(lc->groups[i], lc->inodes_per_group * sizeof(uint16_t));
+        }
+        free(lc->groups);
+        free(lc->in_use);
+        free(lc->overflow_keys);
+        free(lc->overflow_counts);
+        free(lc);
+}
+
+#ifdef TESTLINKCOUNT
+
+int main(int argc, char *argv[])
+{
+        // a small budget so later groups land in the spill file
+        spill_init(4096);
+        link_count_t *lc = lc_new(4, 1024);
+
+        lc_add(lc, 1, 1);
+        lc_add(lc, 1025, 2);
+        for (int i = 0; i < 70000; i++) {
+                lc_add(lc, 2, 1);
+        }
+        for (int i = 0; i < 200; i++) {
+                lc_add(lc, 3000 + i, LINK_COUNT_SATURATED + i);
+        }
+
+        printf("count[1] = %d\n", lc_get(lc, 1));
+        printf("count[1025] = %d\n", lc_get(lc, 1025));
+        printf("count[2] = %d\n", lc_get(lc, 2));
+        printf("count[3199] = %d\n", lc_get(lc, 3199));
+        printf("count[4000] = %d\n", lc_get(lc, 4000));
+        for (int i = 0; i < 4; i++) {
+                printf("group %d active: %d\n", i, lc_group_active(lc, i));
+        }
+
+        lc_reset(lc);
+        printf("after reset count[2] = %d overflow %d\n", lc_get(lc, 2), lc->overflow_len);
+
+        lc_delete(lc);
+        spill_close();
+        return 0;
+}
+
+#endif
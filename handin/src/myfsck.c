@@ -1,21 +1,59 @@
 #include <getopt.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "myfsck.h"
+#include "backend.h"
 #include "checker.h"
+#include "chunked.h"
+#include "clone.h"
 #include "disk.h"
+#include "overlay.h"
+#include "plan.h"
+#include "readwrite.h"
+#include "spill.h"
 #include "util/partition.h"
 #include "util/printer.h"
+#include "writeback.h"
 
-const char *optstring = "p:f:i:";
+extern const unsigned int sector_size_bytes;
+
+const char *optstring = "p:f:i:j:Dn";
+const struct option longopts[] = {
+        {"max-memory", required_argument, NULL, 'm'},
+        {"save-plan", required_argument, NULL, 's'},
+        {"apply-plan", required_argument, NULL, 'a'},
+        {"undo-file", required_argument, NULL, 'u'},
+        {"overlay", required_argument, NULL, 'o'},
+        {"repair-into", required_argument, NULL, 'r'},
+        {"async-writeback", no_argument, NULL, 'w'},
+        {"io", required_argument, NULL, 'I'},
+        {NULL, 0, NULL, 0}
+};
 const char *usage_strings[] = {"[-p <partition number>]",
                                "[-f <partition number>]",
-                               "[-i /path/to/disk/image/]"};
+                               "[-i /path/to/disk/image/]",
+                               "[-j <threads>]",
+                               "[-D]",
+                               "[-n]",
+                               "[--max-memory <bytes>[K|M|G]]",
+                               "[--save-plan <file>]",
+                               "[--apply-plan <file>]",
+                               "[--undo-file <file>]",
+                               "[--overlay <file>]",
+                               "[--repair-into <new image>]",
+                               "[--async-writeback]",
+                               "[--io pread|mmap|memory]"};
 
 int pass = 0;
+int jobs = 1; // worker threads for the parallel passes
+long long max_memory = 0; // memory budget in bytes, 0 for no limit
+int optimize_dirs = 0; // repack directories after the reference counts
+const char *io_backend = "pread"; // how the image is read, see backend.h
+int read_only = 0; // the image is never written, repairs stay in memory or an overlay
 
 void print_usage(char *name)
 {
@@ -28,6 +66,32 @@ void print_usage(char *name)
         exit(-1);
 }
 
+// parse a size with an optional K, M or G suffix, -1 when malformed
+static long long parse_size(const char *str)
+{
+        char *end;
+        long long size = strtoll(str, &end, 10);
+
+        switch (*end) {
+        case 'K': case 'k':
+                size <<= 10;
+                end++;
+                break;
+        case 'M': case 'm':
+                size <<= 20;
+                end++;
+                break;
+        case 'G': case 'g':
+                size <<= 30;
+                end++;
+                break;
+        }
+        if (end == str || *end != '\0' || size <= 0) {
+                return -1;
+        }
+        return size;
+}
+
 int main(int argc, char *argv[])
 {
         int read_partition = 0;
@@ -36,6 +100,13 @@ int main(int argc, char *argv[])
         int fix_partition_number;
         int partition_number, opt;
         char path_to_disk_image[256];
+        char *save_plan = NULL;
+        char *apply_plan = NULL;
+        char *undo_file = NULL;
+        char *overlay_file = NULL;
+        char *repair_into = NULL;
+        int dry_run = 0;
+        int async_writeback = 0;
 
         disk_t disk;
         
@@ -43,7 +114,7 @@ int main(int argc, char *argv[])
                 print_usage(argv[0]);
         }
 
-        while ((opt = getopt(argc, argv, optstring)) != -1) {
+        while ((opt = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
                 switch (opt) {
                 case 'p':
                         partition_number = atoi(optarg);
@@ -64,11 +135,134 @@ int main(int argc, char *argv[])
                         }
                         fix_partition = 1;
                         break;
+                case 'j':
+                        jobs = atoi(optarg);
+                        if (jobs < 1) {
+                                printf("wrong thread count %d\n", jobs);
+                                return -1;
+                        }
+                        break;
+                case 'D':
+                        optimize_dirs = 1;
+                        break;
+                case 'n':
+                        dry_run = 1;
+                        break;
+                case 'm':
+                        max_memory = parse_size(optarg);
+                        if (max_memory < 0) {
+                                printf("wrong memory size %s\n", optarg);
+                                return -1;
+                        }
+                        break;
+                case 's':
+                        save_plan = optarg;
+                        break;
+                case 'a':
+                        apply_plan = optarg;
+                        break;
+                case 'u':
+                        undo_file = optarg;
+                        break;
+                case 'o':
+                        overlay_file = optarg;
+                        break;
+                case 'w':
+                        async_writeback = 1;
+                        break;
+                case 'I':
+                        if (!find_backend(optarg)) {
+                                printf("unknown I/O backend %s, use pread, mmap or memory\n", optarg);
+                                return -1;
+                        }
+                        io_backend = optarg;
+                        break;
+                case 'r':
+                        if (strlen(optarg) >= sizeof(path_to_disk_image)) {
+                                printf("path too long!\n");
+                                print_usage(argv[0]);
+                        }
+                        repair_into = optarg;
+                        break;
+                }
+        }
+
+        if (max_memory) {
+                // entries of a windowed inode table are only valid until
+                // other tables are read, which workers could do meanwhile
+                jobs = 1;
+                // half the budget is left for the inode table window
+                spill_init(max_memory / 2);
+        }
+
+        // the source is left as it is, everything after works on the clone
+        if (repair_into) {
+                int method = clone_image(path_to_disk_image, repair_into);
+                printf("Repairing into %s, %s\n", repair_into,
+                       method == CLONE_REFLINK ? "cloned by reflink" : "cloned by sparse copy");
+                strncpy(path_to_disk_image, repair_into, sizeof(path_to_disk_image));
+        }
+
+        read_only = dry_run || overlay_file != NULL;
+
+        // a compressed image is never written, repairs go to an overlay
+        int64_t image_size = chunked_probe(path_to_disk_image);
+        if (image_size >= 0) {
+                if (!read_only && (fix_partition || apply_plan)) {
+                        printf("%s is compressed, repair it with --overlay or check it with -n\n",
+                               path_to_disk_image);
+                        return -1;
+                }
+                read_only = 1;
+        }
+
+        // the overlay is read from the first sector on, partition table included
+        if (overlay_file) {
+                if (image_size < 0) {
+                        struct stat st;
+                        if (stat(path_to_disk_image, &st) < 0) {
+                                perror(path_to_disk_image);
+                                return -1;
+                        }
+                        image_size = st.st_size;
+                }
+                if (overlay_open(overlay_file, image_size / sector_size_bytes) < 0) {
+                        printf("%s is not an overlay of %s\n", overlay_file, path_to_disk_image);
+                        return -1;
                 }
         }
 
         // open the disk
         open_disk(path_to_disk_image, &disk, fix_partition);
+
+        if (apply_plan) {
+                if (plan_load(apply_plan) < 0) {
+                        printf("%s is not a repair plan\n", apply_plan);
+                        goto END;
+                }
+                int sectors = plan_sectors();
+                if (overlay_active()) {
+                        plan_drain(image_backend()->write);
+                        printf("Applied %d sectors from %s to %s\n", sectors, apply_plan, overlay_file);
+                } else if (!dry_run) {
+                        int writes = plan_apply(image_backend(), undo_file);
+                        printf("Applied %d sectors from %s in %d writes\n", sectors, apply_plan, writes);
+                }
+                goto END;
+        }
+
+        // repairs are collected and written in one sorted pass at the end,
+        // or pass by pass behind the checker when they go straight to the image
+        if (fix_partition) {
+                plan_init();
+                if (async_writeback) {
+                        if (read_only || save_plan || undo_file) {
+                                printf("--async-writeback only applies to repairs in place, ignored\n");
+                        } else {
+                                writeback_start(image_backend());
+                        }
+                }
+        }
         // part I
         if (read_partition) {
                 print_partitions(&disk, partition_number);
@@ -105,7 +299,25 @@ int main(int argc, char *argv[])
         do_check(disk.partitions[fix_partition_number-1]);
 
 END:
+        if (plan_active()) {
+                if (save_plan) {
+                        int runs = plan_save(save_plan);
+                        printf("Repair plan saved to %s: %d sectors in %d runs\n",
+                               save_plan, plan_sectors(), runs);
+                } else if (overlay_active()) {
+                        plan_drain(image_backend()->write);
+                } else if (dry_run) {
+                        if (plan_sectors() > 0) {
+                                printf("Dry run, %d sectors left unwritten\n", plan_sectors());
+                        }
+                } else {
+                        plan_apply(image_backend(), undo_file);
+                }
+        }
+        plan_close();
+        overlay_close();
         free_disk(&disk);
+        spill_close();
 
         return 0;
 }
@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "overlay.h"
+
+#define OVERLAY_MAGIC "MYFSOVLY"
+#define OVERLAY_VERSION 1
+
+// the bitmap and the data start on this alignment
+#define OVERLAY_ALIGN 4096
+
+extern const unsigned int sector_size_bytes;
+
+// header of an overlay file. The bitmap of sectors present follows it, then
+// every sector of the image at its own offset, written ones only, so the
+// file stays sparse.
+typedef struct overlay_header_s {
+        char magic[8];
+        uint32_t version;
+        uint32_t sector_size;
+        uint64_t sector_count;
+        uint64_t bitmap_offset;
+        uint64_t data_offset;
+} overlay_header_t;
+
+static int overlay_fd = -1;
+static overlay_header_t header;
+static unsigned char *present = NULL;
+static size_t bitmap_bytes = 0;
+static int bitmap_dirty = 0;
+
+static inline int is_present(int64_t sector)
+{
+        return (present[sector / 8] >> (sector % 8)) & 0x1;
+}
+
+static inline off_t align(off_t offset)
+{
+        return (offset + OVERLAY_ALIGN - 1) / OVERLAY_ALIGN * OVERLAY_ALIGN;
+}
+
+// open the overlay of an image of sector_count sectors, creating it when
+// the file is empty. Returns -1 when it belongs to an image of another size.
+int overlay_open(const char *path, int64_t sector_count)
+{
+        overlay_fd = open(path, O_RDWR | O_CREAT, 0644);
+        if (overlay_fd < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+        }
+        bitmap_bytes = (sector_count + 7) / 8;
+        present = calloc(bitmap_bytes, 1);
+        if (!present) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        ssize_t n = pread(overlay_fd, &header, sizeof(header), 0);
+        if (n == 0) {
+                memset(&header, 0, sizeof(header));
+                memcpy(header.magic, OVERLAY_MAGIC, sizeof(header.magic));
+                header.version = OVERLAY_VERSION;
+                header.sector_size = sector_size_bytes;
+                header.sector_count = sector_count;
+                header.bitmap_offset = OVERLAY_ALIGN;
+                header.data_offset = align(OVERLAY_ALIGN + bitmap_bytes);
+                if (pwrite(overlay_fd, &header, sizeof(header), 0) != sizeof(header)
+                    || ftruncate(overlay_fd, header.data_offset + sector_count * sector_size_bytes) < 0) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+                }
+                return 0;
+        }
+
+        if (n != sizeof(header) || memcmp(header.magic, OVERLAY_MAGIC, sizeof(header.magic)) != 0
+            || header.version != OVERLAY_VERSION || header.sector_size != sector_size_bytes
+            || header.sector_count != sector_count) {
+                overlay_close();
+                return -1;
+        }
+        if (pread(overlay_fd, present, bitmap_bytes, header.bitmap_offset) != bitmap_bytes) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+        }
+
+        return 0;
+}
+
+int overlay_active(void)
+{
+        return overlay_fd >= 0;
+}
+
+// replace the sectors just read from the image by those in the overlay
+void overlay_read(int64_t start_sector, unsigned int num_sectors, void *into)
+{
+        if (overlay_fd < 0) {
+                return;
+        }
+        for (unsigned int i = 0; i < num_sectors; i++) {
+                if (start_sector + i >= header.sector_count || !is_present(start_sector + i)) {
+                        continue;
+                }
+                unsigned int run = 1;
+                while (i + run < num_sectors && start_sector + i + run < header.sector_count
+                       && is_present(start_sector + i + run)) {
+                        run++;
+                }
+                size_t bytes = (size_t)run * sector_size_bytes;
+                off_t offset = header.data_offset + (start_sector + i) * sector_size_bytes;
+                if (pread(overlay_fd, (char *)into + (size_t)i * sector_size_bytes, bytes, offset) != bytes) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                i += run - 1;
+        }
+}
+
+void overlay_write(int64_t start_sector, unsigned int num_sectors, const void *from)
+{
+        if (start_sector + num_sectors > header.sector_count) {
+                error_at_line(-1, 0, __FILE__, __LINE__, "write past the end of the image");
+        }
+
+        size_t bytes = (size_t)num_sectors * sector_size_bytes;
+        off_t offset = header.data_offset + start_sector * sector_size_bytes;
+        if (pwrite(overlay_fd, from, bytes, offset) != bytes) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        for (unsigned int i = 0; i < num_sectors; i++) {
+                present[(start_sector + i) / 8] |= 0x1 << ((start_sector + i) % 8);
+        }
+        bitmap_dirty = 1;
+}
+
+// write the bitmap back after the data it marks, and close the overlay
+int overlay_close(void)
+{
+        if (overlay_fd < 0) {
+                return 0;
+        }
+        if (bitmap_dirty) {
+                if (fdatasync(overlay_fd) < 0
+                    || pwrite(overlay_fd, present, bitmap_bytes, header.bitmap_offset) != bitmap_bytes
+                    || fdatasync(overlay_fd) < 0) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+        }
+        close(overlay_fd);
+        overlay_fd = -1;
+        free(present);
+        present = NULL;
+        bitmap_dirty = 0;
+
+        return 0;
+}
+
+// the overlay as a backend over the one the image is read through, sectors
+// it has read from it and every write goes to it
+
+static const backend_t *lower_backend = NULL;
+
+static void overlay_backend_read(int64_t start_sector, unsigned int num_sectors, void *into)
+{
+        lower_backend->read(start_sector, num_sectors, into);
+        overlay_read(start_sector, num_sectors, into);
+}
+
+static void overlay_backend_readv(sector_run_t *runs, int count)
+{
+        lower_backend->readv(runs, count);
+        for (int i = 0; i < count; i++) {
+                overlay_read(runs[i].start_sector, runs[i].num_sectors, runs[i].buf);
+        }
+}
+
+static int overlay_backend_flush(void)
+{
+        if (overlay_fd >= 0 && fdatasync(overlay_fd) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        return 0;
+}
+
+static int64_t overlay_backend_size(void)
+{
+        return header.sector_count;
+}
+
+static void overlay_backend_hint(int64_t start_sector, int64_t num_sectors, int advice)
+{
+        lower_backend->hint(start_sector, num_sectors, advice);
+}
+
+static void overlay_backend_close(void)
+{
+        overlay_close();
+        lower_backend->close();
+}
+
+static const backend_t overlay_backend = {
+        "overlay", NULL, overlay_backend_read, overlay_backend_readv, overlay_write,
+        overlay_backend_flush, overlay_backend_size, overlay_backend_hint, overlay_backend_close
+};
+
+const backend_t *overlay_backend_over(const backend_t *lower)
+{
+        lower_backend = lower;
+        return &overlay_backend;
+}
@@ -1,11 +1,13 @@
 #include <errno.h>
 #include <error.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "disk.h"
 #include "genhd.h"
+#include "htree.h"
 #include "readwrite.h"
 #include "slice.h"
 
@@ -74,6 +76,22 @@ char * read_block(partition_t *pt, int block_index, int count)
         return buf;
 }
 
+// the first sector of a block on the disk
+int64_t get_block_sector(partition_t *pt, int block_index)
+{
+        return pt->base_sector +
+                pt->partition_info->start_sect +
+                (int64_t)block_index * (get_block_size(pt) / sector_size_bytes);
+}
+
+// tell the backend how count blocks are going to be read
+void hint_blocks(partition_t *pt, int block_index, int count, int advice)
+{
+        int sectors_per_block = get_block_size(pt) / sector_size_bytes;
+
+        hint_sectors(get_block_sector(pt, block_index), (int64_t)sectors_per_block * count, advice);
+}
+
 int write_block(partition_t *pt, int block_index, int count, char *buf)
 {
         int block_size = get_block_size(pt);
@@ -94,6 +112,33 @@ int write_block(partition_t *pt, int block_index, int count, char *buf)
         return 0;
 }
 
+// write the sectors of count blocks held in buf whose dirty flag is set,
+// adjacent ones with one write, and clear the flags
+int write_dirty_sectors(partition_t *pt, int block_index, int count, char *buf, char *dirty)
+{
+        int sectors_per_block = get_block_size(pt) / sector_size_bytes;
+        int sector_count = sectors_per_block * count;
+        int sector_offset =
+                pt->base_sector +
+                pt->partition_info->start_sect +
+                block_index * sectors_per_block;
+
+        for (int i = 0; i < sector_count; i++) {
+                if (!dirty[i]) {
+                        continue;
+                }
+                int run = 1;
+                while (i + run < sector_count && dirty[i + run]) {
+                        run++;
+                }
+                write_sectors(sector_offset + i, run, buf + i*sector_size_bytes);
+                memset(dirty + i, 0, run);
+                i += run - 1;
+        }
+
+        return 0;
+}
+
 // getters for one group
 int get_block_bitmap_bid(group_t *g)
 {
@@ -120,6 +165,34 @@ int get_free_inodes_count(group_t *g)
         return g->desc->bg_free_inodes_count;
 }
 
+// number of blocks in a group, the last group may be short
+int get_blocks_in_group(partition_t *pt, int group_number)
+{
+        int blocks_per_group = get_blocks_per_group(pt);
+        int remain = pt->super_block->s_blocks_count - pt->super_block->s_first_data_block
+                - group_number * blocks_per_group;
+
+        return remain < blocks_per_group ? remain : blocks_per_group;
+}
+
+// count the set bits among the first nbits of a bitmap, a word at a time
+int count_set_bits(char *map, int nbits)
+{
+        int count = 0;
+        int words = nbits / 64;
+        uint64_t word;
+
+        for (int i = 0; i < words; i++) {
+                memcpy(&word, map + i * sizeof(word), sizeof(word));
+                count += __builtin_popcountll(word);
+        }
+        for (int i = words * 64; i < nbits; i++) {
+                count += (map[i / 8] >> (i % 8)) & 0x1;
+        }
+
+        return count;
+}
+
 // test if the inode/block is allocated in the bitmap
 static inline int allocated(char *map, int offset)
 {
@@ -130,6 +203,47 @@ static inline int allocated(char *map, int offset)
         return (map[byte_offset] >> bit_offset) & 0x1;
 }
 
+// clear a block in the bitmap of its group and count it as free in the
+// group and the superblock, returns the group. The bitmap is written by
+// flush_block_bitmaps().
+int release_block(partition_t *pt, int block_number)
+{
+        int blocks_per_group = get_blocks_per_group(pt);
+        int group_number = (block_number - 1) / blocks_per_group;
+        int block_offset_in_group = (block_number - 1) % blocks_per_group;
+        group_t *g = pt->groups[group_number];
+
+        char mask = 0x1 << (block_offset_in_group % 8);
+        if (g->block_bitmap[block_offset_in_group / 8] & mask) {
+                g->block_bitmap[block_offset_in_group / 8] &= ~mask;
+                g->bitmap_dirty[block_offset_in_group / 8 / sector_size_bytes] = 1;
+                g->desc->bg_free_blocks_count++;
+                pt->super_block->s_free_blocks_count++;
+        }
+
+        return group_number;
+}
+
+// set a block in the bitmap of its group and count it as used in the
+// group and the superblock, returns the group
+int claim_block(partition_t *pt, int block_number)
+{
+        int blocks_per_group = get_blocks_per_group(pt);
+        int group_number = (block_number - 1) / blocks_per_group;
+        int block_offset_in_group = (block_number - 1) % blocks_per_group;
+        group_t *g = pt->groups[group_number];
+
+        char mask = 0x1 << (block_offset_in_group % 8);
+        if (!(g->block_bitmap[block_offset_in_group / 8] & mask)) {
+                g->block_bitmap[block_offset_in_group / 8] |= mask;
+                g->bitmap_dirty[block_offset_in_group / 8 / sector_size_bytes] = 1;
+                g->desc->bg_free_blocks_count--;
+                pt->super_block->s_free_blocks_count--;
+        }
+
+        return group_number;
+}
+
 // test if a block is allocated in the bitmap
 int block_allocated(partition_t *pt, int block_number)
 {
@@ -167,7 +281,25 @@ struct ext2_inode * get_inode_entry(partition_t *pt, int inode_id)
         int group_number = (inode_id - 1) / inodes_per_group;
         int inode_offset_in_group = (inode_id - 1) % inodes_per_group;
 
-        return pt->groups[group_number]->inode_table[inode_offset_in_group];
+        return get_inode_table(pt, group_number)[inode_offset_in_group];
+}
+
+// an entry that stays valid, however many tables are read, until it is
+// passed to unpin_inode_entry()
+struct ext2_inode * pin_inode_entry(partition_t *pt, int inode_id)
+{
+        struct ext2_inode *inode = get_inode_entry(pt, inode_id);
+        if (inode != NULL) {
+                pt->groups[(inode_id - 1) / get_inodes_per_group(pt)]->pins++;
+        }
+        return inode;
+}
+
+void unpin_inode_entry(partition_t *pt, int inode_id)
+{
+        if (is_valid_inode(pt, inode_id)) {
+                pt->groups[(inode_id - 1) / get_inodes_per_group(pt)]->pins--;
+        }
 }
 
 int is_dir(partition_t *pt, int inode_id)
@@ -185,6 +317,24 @@ int is_symbol(partition_t *pt, int inode_id)
         return (inode->i_mode & EXT2_S_IFLNK) == EXT2_S_IFLNK;
 }
 
+// mark the table sector of an inode changed in memory, it is written by the
+// next flush_inode_tables() or when its table leaves the window
+int mark_inode_dirty(partition_t *pt, int inode_id)
+{
+        if (get_inode_entry(pt, inode_id) == NULL) {
+                return -1;
+        }
+
+        int inodes_per_group = get_inodes_per_group(pt);
+        int inodes_per_sector = sector_size_bytes / sizeof(struct ext2_inode);
+        int group_number = (inode_id - 1) / inodes_per_group;
+        int index = (inode_id - 1) % inodes_per_group;
+
+        pt->groups[group_number]->inode_dirty[index / inodes_per_sector] = 1;
+
+        return 0;
+}
+
 int get_dir(partition_t *pt, int inode_id, struct ext2_dir_entry_2 *dir)
 {
         struct ext2_inode *inode = get_inode_entry(pt, inode_id);
@@ -196,14 +346,39 @@ int get_dir(partition_t *pt, int inode_id, struct ext2_dir_entry_2 *dir)
         return 0;
 }
 
+// get the inode the '..' entry of a directory points to
+int get_parent_inode(partition_t *pt, int inode_id)
+{
+        struct ext2_dir_entry_2 dir;
+        struct ext2_inode *inode = get_inode_entry(pt, inode_id);
+        if (inode == NULL || inode->i_block[0] == 0) {
+                return 0;
+        }
+
+        char *block = read_block(pt, inode->i_block[0], 1);
+        memcpy(&dir, block, sizeof(dir));
+        if (dir.rec_len < 12 || dir.rec_len >= get_block_size(pt)) {
+                free(block);
+                return 0;
+        }
+        memcpy(&dir, block+dir.rec_len, MIN(sizeof(dir), get_block_size(pt) - dir.rec_len));
+        free(block);
+
+        return dir.inode;
+}
+
 static int get_indirect_block(slice_t *slice, partition_t *pt, int block_id)
 {
         int entries_per_block = get_block_size(pt) / 4; // 32-bit int
+        if (block_id == 0) {
+                return 0;
+        }
         int *block = (int *)read_block(pt, block_id, 1);
         int i;
 
         for (i = 0; i < entries_per_block; i++) {
                 if (block[i] == 0) {
+                        free(block);
                         return 0;
                 }
                 append(slice, &block[i]);
@@ -216,15 +391,20 @@ static int get_indirect_block(slice_t *slice, partition_t *pt, int block_id)
 static int get_double_indirect_block(slice_t *slice, partition_t *pt, int block_id)
 {
         int entries_per_block = get_block_size(pt) / 4; // 32-bit int
+        if (block_id == 0) {
+                return 0;
+        }
         int *indirect_block = (int *)read_block(pt, block_id, 1);
         int i;
 
         for (i = 0; i < entries_per_block; i++) {
                 if (indirect_block[i] == 0) {
+                        free(indirect_block);
                         return 0;
                 }
                 int ret = get_indirect_block(slice, pt, indirect_block[i]);
                 if (ret == 0) {
+                        free(indirect_block);
                         return 0;
                 }
         }
@@ -236,15 +416,20 @@ static int get_double_indirect_block(slice_t *slice, partition_t *pt, int block_
 static int get_triple_indirect_block(slice_t *slice, partition_t *pt, int block_id)
 {
         int entries_per_block = get_block_size(pt) / 4; // 32-bit int
+        if (block_id == 0) {
+                return 0;
+        }
         int *double_indirect_block = (int *)read_block(pt, block_id, 1);
         int i;
 
         for (i = 0; i < entries_per_block; i++) {
                 if (double_indirect_block[i] == 0) {
+                        free(double_indirect_block);
                         return 0;
                 }
                 int ret = get_double_indirect_block(slice, pt, double_indirect_block[i]);
                 if (ret == 0) {
+                        free(double_indirect_block);
                         return 0;
                 }
         }
@@ -277,6 +462,48 @@ slice_t * get_blocks(partition_t *pt, int inode_id)
         return slice;
 }
 
+// the block holding the index-th block of a file, 0 for a hole
+int get_block_id(partition_t *pt, int inode_id, int index)
+{
+        struct ext2_inode *inode = get_inode_entry(pt, inode_id);
+        int entries_per_block = get_block_size(pt) / 4; // 32-bit int
+        int block_id, depth;
+
+        if (inode == NULL || index < 0) {
+                return 0;
+        }
+        if (index < EXT2_NDIR_BLOCKS) {
+                return inode->i_block[index];
+        }
+
+        index -= EXT2_NDIR_BLOCKS;
+        if (index < entries_per_block) {
+                block_id = inode->i_block[EXT2_IND_BLOCK];
+                depth = 1;
+        } else if ((index -= entries_per_block) < entries_per_block * entries_per_block) {
+                block_id = inode->i_block[EXT2_DIND_BLOCK];
+                depth = 2;
+        } else {
+                index -= entries_per_block * entries_per_block;
+                block_id = inode->i_block[EXT2_TIND_BLOCK];
+                depth = 3;
+        }
+
+        // walk down one indirect block per level
+        for (; depth > 0 && block_id != 0; depth--) {
+                int span = 1;
+                for (int i = 1; i < depth; i++) {
+                        span *= entries_per_block;
+                }
+                int *block = (int *)read_block(pt, block_id, 1);
+                block_id = block[index / span];
+                index %= span;
+                free(block);
+        }
+
+        return block_id;
+}
+
 static int add_child_inodes(partition_t *pt, slice_t *s, int block_id)
 {
         int block_size = get_block_size(pt);
@@ -285,16 +512,19 @@ static int add_child_inodes(partition_t *pt, slice_t *s, int block_id)
         struct ext2_dir_entry_2 dir;
 
         for(;;) {
-                if (offset >= block_size) {
+                if (offset + 8 > block_size) {
                         break;
                 }
                 memcpy(&dir, block+offset, MIN(sizeof(dir), (block_size - offset)));
+                if (dir.rec_len < 8 || offset + dir.rec_len > block_size) {
+                        break; // broken chain
+                }
+                offset += dir.rec_len;
                 if (dir.inode == 0) {
-                        break;
+                        continue; // a deleted entry, more may follow
                 }
 
                 append(s, &dir.inode);
-                offset += dir.rec_len;
         }
 
         free(block);
@@ -302,26 +532,37 @@ static int add_child_inodes(partition_t *pt, slice_t *s, int block_id)
         return 0;
 }
 
-static int add_child_dirs(partition_t *pt, slice_t *s, int block_id)
+// append the entries in use of a directory block that is already read
+int get_block_dirs(partition_t *pt, char *block, slice_t *s)
 {
         int block_size = get_block_size(pt);
-        char *block = read_block(pt, block_id, 1);
         int offset = 0;
         struct ext2_dir_entry_2 dir;
 
         for(;;) {
-                if (offset >= block_size) {
+                if (offset + 8 > block_size) {
                         break;
                 }
                 memcpy(&dir, block+offset, MIN(sizeof(dir), (block_size - offset)));
+                if (dir.rec_len < 8 || offset + dir.rec_len > block_size) {
+                        break; // broken chain
+                }
+                offset += dir.rec_len;
                 if (dir.inode == 0) {
-                        break;
+                        continue; // a deleted entry, more may follow
                 }
 
                 append(s, &dir);
-                offset += dir.rec_len;
         }
 
+        return 0;
+}
+
+static int add_child_dirs(partition_t *pt, slice_t *s, int block_id)
+{
+        char *block = read_block(pt, block_id, 1);
+
+        get_block_dirs(pt, block, s);
         free(block);
 
         return 0;
@@ -356,21 +597,59 @@ slice_t * get_child_dirs(partition_t *pt, int inode_id)
 
         delete_slice(block_slice);
 
+        // later lookups of these names need not read the blocks again
+        struct ext2_dir_entry_2 dir;
+        for (int i = 0; i < dir_slice->len; i++) {
+                get(dir_slice, i, &dir);
+                dcache_insert(pt->dcache, inode_id, &dir);
+        }
+
         return dir_slice;
 }
 
-int get_lost_found_inode(partition_t *pt)
+// the inode name refers to in a directory, 0 when there is none. The
+// entry cache answers first, then the hash index of an indexed directory,
+// and the blocks are only scanned when neither can.
+int lookup_child(partition_t *pt, int dir_inode, const char *name, int name_len,
+                 struct ext2_dir_entry_2 *ret)
 {
-        slice_t *s = get_child_dirs(pt, 2); // get chilren of root
+        int inode = dcache_lookup(pt->dcache, dir_inode, name, name_len, ret);
+        if (inode != DCACHE_MISS) {
+                return inode;
+        }
+
+        inode = htree_find_child(pt, dir_inode, name, name_len, ret);
+        if (inode == HTREE_UNUSABLE) {
+                // reading the children caches them for later lookups
+                inode = 0;
+                slice_t *s = get_child_dirs(pt, dir_inode);
+                struct ext2_dir_entry_2 dir;
+                for (int i = 0; i < s->len; i++) {
+                        get(s, i, &dir);
+                        if (dir.name_len == name_len && memcmp(dir.name, name, name_len) == 0) {
+                                inode = dir.inode;
+                                if (ret) {
+                                        memcpy(ret, &dir, sizeof(dir));
+                                }
+                                break;
+                        }
+                }
+                delete_slice(s);
+        }
+        if (inode == 0) {
+                dcache_insert_negative(pt->dcache, dir_inode, name, name_len);
+        }
 
+        return inode;
+}
+
+int get_lost_found_inode(partition_t *pt)
+{
         char *lost_found = "lost+found";
 
-        struct ext2_dir_entry_2 dir;
-        for (int i = 0; i < s->len; i++) {
-                get(s, i, &dir);
-                if (strncmp(dir.name, "lost+found", strlen(lost_found)) == 0) {
-                        return dir.inode;
-                }
+        int inode = lookup_child(pt, 2, lost_found, strlen(lost_found), NULL);
+        if (inode > 0) {
+                return inode;
         }
         printf("warning: no lost+found\n");
         return 0;
@@ -380,6 +659,7 @@ slice_t * get_allocated_blocks(partition_t *pt, int inode)
 {
         int *block_buf;
         int *second_block_buf;
+        int entries_per_block = get_block_size(pt) / 4; // 32-bit int
 
         slice_t *s = get_blocks(pt, inode);
         struct ext2_inode *entry = get_inode_entry(pt, inode);
@@ -395,7 +675,7 @@ slice_t * get_allocated_blocks(partition_t *pt, int inode)
                 int i = 0;
                 block_buf = (int *)read_block(pt, entry->i_block[EXT2_DIND_BLOCK], 1);
                 // one block for each indirect block pointed by the double-indirect block
-                while (block_buf[i] != 0) {
+                while (i < entries_per_block && block_buf[i] != 0) {
                         append(s, &block_buf[i]);
                         i++;
                 }
@@ -406,30 +686,30 @@ slice_t * get_allocated_blocks(partition_t *pt, int inode)
                 append(s, &entry->i_block[EXT2_TIND_BLOCK]);
 
                 int i = 0;
-                int j = 0;
-                block_buf = (int *)read_block(pt, entry->i_block[EXT2_DIND_BLOCK], 1);
-                while (block_buf[i] != 0) {
+                block_buf = (int *)read_block(pt, entry->i_block[EXT2_TIND_BLOCK], 1);
+                while (i < entries_per_block && block_buf[i] != 0) {
                         // one block for each double-indirect block pointed by the triple-indirect block
                         append(s, &block_buf[i]);
 
+                        int j = 0;
                         second_block_buf = (int *)read_block(pt, block_buf[i], 1);
-                        while (second_block_buf[j] != 0) {
-                                // one block for each triple-indirect block pointed by the double-indirect block
+                        while (j < entries_per_block && second_block_buf[j] != 0) {
+                                // one block for each indirect block pointed by the double-indirect block
                                 append(s, &second_block_buf[j]);
                                 j++;
                         }
+                        free(second_block_buf);
 
                         i++;
                 }
                 free(block_buf);
-                free(second_block_buf);
         }
         return s;
 }
 
 int is_valid_inode(partition_t *pt, int inode)
 {
-        if (inode < 0 || inode > pt->super_block->s_inodes_count) {
+        if (inode <= 0 || inode > pt->super_block->s_inodes_count) {
                 return 0;
         }
         return 1;
@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "plan.h"
+#include "spill.h"
+#include "undo.h"
+#include "writeback.h"
+
+// sectors written back with one write at most, 1 MiB
+#define PLAN_BATCH_SECTORS 2048
+
+#define PLAN_MAGIC "MYFSPLAN"
+#define PLAN_VERSION 1
+
+extern const unsigned int sector_size_bytes;
+
+// header of a saved plan, followed by its runs
+typedef struct plan_header_s {
+        char magic[8];
+        uint32_t version;
+        uint32_t sector_size;
+        uint64_t run_count;
+} plan_header_t;
+
+// one run of adjacent sectors in a saved plan, followed by their contents
+typedef struct plan_run_s {
+        uint64_t start_sector;
+        uint32_t num_sectors;
+        uint32_t reserved;
+} plan_run_t;
+
+// the sectors to write, an open addressing map from sector number to a
+// slot in data, the last write of a sector replaces the earlier ones. The
+// map counts against the memory budget and spills past it like the rest.
+static int active = 0;
+static int64_t *keys = NULL;
+static int *slots = NULL;
+static int cap = 0;
+static int len = 0;
+static char *data = NULL;
+static char *queued = NULL; // per slot, handed to the writeback thread as it is
+static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// record writes from now on instead of passing them to the disk
+int plan_init(void)
+{
+        active = 1;
+        return 0;
+}
+
+int plan_active(void)
+{
+        return active;
+}
+
+int plan_sectors(void)
+{
+        return len;
+}
+
+static inline int find_slot(int64_t sector)
+{
+        int i = (uint64_t)sector * 11400714819323198485ull >> 32 & (cap - 1);
+        while (keys[i] != -1 && keys[i] != sector) {
+                i = (i + 1) & (cap - 1);
+        }
+        return i;
+}
+
+static void grow(void)
+{
+        int64_t *old_keys = keys;
+        int *old_slots = slots;
+        char *old_data = data;
+        char *old_queued = queued;
+        int old_cap = cap;
+
+        cap = cap ? cap * 2 : 1024;
+        keys = spill_calloc(cap, sizeof(int64_t));
+        slots = spill_calloc(cap, sizeof(int));
+        data = spill_calloc(cap / 2, sector_size_bytes);
+        queued = spill_calloc(cap / 2, sizeof(char));
+        memset(keys, -1, sizeof(int64_t) * cap);
+        if (old_cap > 0) {
+                memcpy(data, old_data, (size_t)sector_size_bytes * (old_cap / 2));
+                memcpy(queued, old_queued, old_cap / 2);
+        }
+
+        for (int i = 0; i < old_cap; i++) {
+                if (old_keys[i] != -1) {
+                        int j = find_slot(old_keys[i]);
+                        keys[j] = old_keys[i];
+                        slots[j] = old_slots[i];
+                }
+        }
+        spill_free(old_keys, sizeof(int64_t) * old_cap);
+        spill_free(old_slots, sizeof(int) * old_cap);
+        spill_free(old_data, (size_t)sector_size_bytes * (old_cap / 2));
+        spill_free(old_queued, old_cap / 2);
+}
+
+void plan_record(int64_t start_sector, unsigned int num_sectors, const void *from)
+{
+        pthread_rwlock_wrlock(&lock);
+        for (unsigned int n = 0; n < num_sectors; n++) {
+                // the map is kept at most half full
+                if ((len + 1) * 2 > cap) {
+                        grow();
+                }
+                int i = find_slot(start_sector + n);
+                if (keys[i] == -1) {
+                        keys[i] = start_sector + n;
+                        // plan_overlay() reads len without the lock
+                        slots[i] = __atomic_fetch_add(&len, 1, __ATOMIC_RELAXED);
+                }
+                memcpy(data + (size_t)slots[i] * sector_size_bytes,
+                       (const char *)from + (size_t)n * sector_size_bytes, sector_size_bytes);
+                queued[slots[i]] = 0;
+        }
+        pthread_rwlock_unlock(&lock);
+}
+
+// lay the planned contents over sectors just read from the disk
+void plan_overlay(int64_t start_sector, unsigned int num_sectors, void *into)
+{
+        // nothing planned yet, a write racing this read is not seen by
+        // it either way
+        if (__atomic_load_n(&len, __ATOMIC_RELAXED) == 0) {
+                return;
+        }
+        pthread_rwlock_rdlock(&lock);
+        for (unsigned int n = 0; n < num_sectors; n++) {
+                int i = find_slot(start_sector + n);
+                if (keys[i] != -1) {
+                        memcpy((char *)into + (size_t)n * sector_size_bytes,
+                               data + (size_t)slots[i] * sector_size_bytes, sector_size_bytes);
+                }
+        }
+        pthread_rwlock_unlock(&lock);
+}
+
+static int compare_sector(const void *a, const void *b)
+{
+        int64_t x = keys[*(const int *)a], y = keys[*(const int *)b];
+        return x < y ? -1 : x > y;
+}
+
+// the map positions in use, sorted by sector
+static int *sorted_positions(void)
+{
+        int *order = malloc(sizeof(int) * (len + 1));
+        if (!order) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        int n = 0;
+        for (int i = 0; i < cap; i++) {
+                if (keys[i] != -1) {
+                        order[n++] = i;
+                }
+        }
+        qsort(order, n, sizeof(int), compare_sector);
+        return order;
+}
+
+// the length of the run of adjacent sectors starting at order[first],
+// at most PLAN_BATCH_SECTORS, copied into buf
+static int next_run(int *order, int first, char *buf)
+{
+        int run = 0;
+        while (first + run < len && run < PLAN_BATCH_SECTORS
+               && keys[order[first + run]] == keys[order[first]] + run) {
+                memcpy(buf + (size_t)run * sector_size_bytes,
+                       data + (size_t)slots[order[first + run]] * sector_size_bytes, sector_size_bytes);
+                run++;
+        }
+        return run;
+}
+
+// hand the sectors changed since the last call to the writeback thread,
+// sorted and in runs. They stay in the plan, so reads keep seeing them
+// whether or not the writer got to them yet. Returns the runs handed over.
+int plan_writeback(void)
+{
+        if (!writeback_active()) {
+                return 0;
+        }
+
+        int runs = 0;
+        pthread_rwlock_wrlock(&lock);
+        int *order = sorted_positions();
+        for (int i = 0; i < len; ) {
+                if (queued[slots[order[i]]]) {
+                        i++;
+                        continue;
+                }
+                int run = 1;
+                while (i + run < len && run < PLAN_BATCH_SECTORS && !queued[slots[order[i + run]]]
+                       && keys[order[i + run]] == keys[order[i]] + run) {
+                        run++;
+                }
+
+                char *buf = malloc((size_t)run * sector_size_bytes);
+                if (!buf) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                for (int n = 0; n < run; n++) {
+                        int slot = slots[order[i + n]];
+                        memcpy(buf + (size_t)n * sector_size_bytes,
+                               data + (size_t)slot * sector_size_bytes, sector_size_bytes);
+                        queued[slot] = 1;
+                }
+                writeback_submit(keys[order[i]], run, buf);
+                runs++;
+                i += run;
+        }
+        free(order);
+        pthread_rwlock_unlock(&lock);
+
+        return runs;
+}
+
+// append the current contents of every planned sector to an undo log
+static void save_originals(const backend_t *io, int *order, char *buf)
+{
+        for (int i = 0; i < len; ) {
+                sector_run_t original = {keys[order[i]], next_run(order, i, buf), buf};
+                io->readv(&original, 1);
+                undo_append(original.start_sector, original.num_sectors, buf);
+                i += original.num_sectors;
+        }
+}
+
+// write every planned sector through io in order of sector number, adjacent
+// ones in batches, then sync once. With an undo path the originals are
+// logged and synced first. Returns the number of writes.
+int plan_apply(const backend_t *io, const char *undo_path)
+{
+        int writes = 0;
+        char *buf = malloc((size_t)sector_size_bytes * PLAN_BATCH_SECTORS);
+        if (!buf) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        if (writeback_active()) {
+                // the writer owns everything queued so far, hand over the rest
+                free(buf);
+                plan_writeback();
+                return writeback_finish();
+        }
+
+        int *order = sorted_positions();
+        if (undo_path) {
+                undo_open(undo_path);
+                save_originals(io, order, buf);
+                undo_sync();
+        }
+        for (int i = 0; i < len; ) {
+                int run = next_run(order, i, buf);
+                io->write(keys[order[i]], run, buf);
+                writes++;
+                i += run;
+        }
+        if (len > 0) {
+                io->flush();
+        }
+        if (undo_path) {
+                undo_close();
+        }
+
+        free(order);
+        free(buf);
+        return writes;
+}
+
+// pass every planned run to write in order of sector number, for a
+// target other than the image. Returns the number of runs.
+int plan_drain(void (*write)(int64_t start_sector, unsigned int num_sectors, const void *from))
+{
+        int runs = 0;
+        char *buf = malloc((size_t)sector_size_bytes * PLAN_BATCH_SECTORS);
+        if (!buf) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        int *order = sorted_positions();
+        for (int i = 0; i < len; runs++) {
+                int run = next_run(order, i, buf);
+                write(keys[order[i]], run, buf);
+                i += run;
+        }
+
+        free(order);
+        free(buf);
+        return runs;
+}
+
+// write the plan to a file as sorted runs, to be applied later
+int plan_save(const char *path)
+{
+        FILE *f = fopen(path, "wb");
+        if (!f) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+        }
+        char *buf = malloc((size_t)sector_size_bytes * PLAN_BATCH_SECTORS);
+        if (!buf) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        plan_header_t header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, PLAN_MAGIC, sizeof(header.magic));
+        header.version = PLAN_VERSION;
+        header.sector_size = sector_size_bytes;
+
+        int *order = sorted_positions();
+        for (int i = 0; i < len; i += next_run(order, i, buf)) {
+                header.run_count++;
+        }
+        fwrite(&header, sizeof(header), 1, f);
+
+        for (int i = 0; i < len; ) {
+                plan_run_t run;
+                memset(&run, 0, sizeof(run));
+                run.start_sector = keys[order[i]];
+                run.num_sectors = next_run(order, i, buf);
+                fwrite(&run, sizeof(run), 1, f);
+                fwrite(buf, sector_size_bytes, run.num_sectors, f);
+                i += run.num_sectors;
+        }
+
+        free(order);
+        free(buf);
+        if (ferror(f) | fclose(f)) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+        }
+        return header.run_count;
+}
+
+// read a saved plan into the map, -1 when the file is not one
+int plan_load(const char *path)
+{
+        FILE *f = fopen(path, "rb");
+        if (!f) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+        }
+
+        plan_header_t header;
+        if (fread(&header, sizeof(header), 1, f) != 1
+            || memcmp(header.magic, PLAN_MAGIC, sizeof(header.magic)) != 0
+            || header.version != PLAN_VERSION || header.sector_size != sector_size_bytes) {
+                fclose(f);
+                return -1;
+        }
+
+        char *buf = malloc((size_t)sector_size_bytes * PLAN_BATCH_SECTORS);
+        if (!buf) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        int ret = 0;
+        for (uint64_t i = 0; i < header.run_count; i++) {
+                plan_run_t run;
+                if (fread(&run, sizeof(run), 1, f) != 1 || run.num_sectors > PLAN_BATCH_SECTORS
+                    || fread(buf, sector_size_bytes, run.num_sectors, f) != run.num_sectors) {
+                        ret = -1;
+                        break;
+                }
+                plan_record(run.start_sector, run.num_sectors, buf);
+        }
+
+        free(buf);
+        fclose(f);
+        return ret;
+}
+
+void plan_close(void)
+{
+        spill_free(keys, sizeof(int64_t) * cap);
+        spill_free(slots, sizeof(int) * cap);
+        spill_free(data, (size_t)sector_size_bytes * (cap / 2));
+        spill_free(queued, cap / 2);
+        queued = NULL;
+        keys = NULL;
+        slots = NULL;
+        data = NULL;
+        cap = 0;
+        len = 0;
+        active = 0;
+}
@@ -17,20 +17,14 @@
 // test if the free_blocks_count in group description is consistent with the map
 void verify_block_allocated(partition_t *pt, int group_number)
 {
-        // get blocks per group
-        int blocks_per_group = get_blocks_per_group(pt);
+        // get blocks in this group
+        int blocks_in_group = get_blocks_in_group(pt, group_number);
 
         // get free blocks count
         int free_blocks_count = get_free_blocks_count(pt->groups[group_number]);
 
-        int map_free_blocks_count = 0;
-        int start = group_number * blocks_per_group;
-        int end = start + blocks_per_group;
-        for (int i = start; i < end; i++) {
-                if (!block_allocated(pt, i)) {
-                        map_free_blocks_count++;
-                }
-        }
+        int map_free_blocks_count = blocks_in_group -
+                count_set_bits(pt->groups[group_number]->block_bitmap, blocks_in_group);
 
         printf("====== verify block_allocted partition %d: group %d ======\n", pt->id, group_number);
         if (map_free_blocks_count != free_blocks_count) {
@@ -42,7 +36,7 @@ void verify_block_allocated(partition_t *pt, int group_number)
         }
 }
 
-// test if the free_blocks_count in group description is consistent with the map
+// test if the free_inodes_count in group description is consistent with the map
 void verify_inode_allocated(partition_t *pt, int group_number)
 {
         // get inodes per group
@@ -51,14 +45,8 @@ void verify_inode_allocated(partition_t *pt, int group_number)
         // get free inodes count
         int free_inodes_count = get_free_inodes_count(pt->groups[group_number]);
 
-        int map_free_inodes_count = 0;
-        int start = group_number * inodes_per_group + 1;
-        int end = start + inodes_per_group;
-        for (int i = start; i < end; i++) {
-                if (!inode_allocated(pt, i)) {
-                        map_free_inodes_count++;
-                }
-        }
+        int map_free_inodes_count = inodes_per_group -
+                count_set_bits(pt->groups[group_number]->inode_bitmap, inodes_per_group);
 
         printf("====== verify inode_allocted partition %d: group %d ======\n", pt->id, group_number);
         if (map_free_inodes_count != free_inodes_count) {
@@ -209,53 +197,6 @@ void print_ls(partition_t *pt, char *path)
         delete_slice(slice);
 }
 
-static int find_child_in_block(partition_t *pt, int block_id, char *childname, struct ext2_dir_entry_2 *ret)
-{
-        int block_size = get_block_size(pt);
-        char *block = read_block(pt, block_id, 1);
-        int offset = 0;
-        struct ext2_dir_entry_2 dir;
-
-        int child_inode = 0;
-        for (;;) {
-                if (offset >= block_size) {
-                        break;
-                }
-
-                memcpy(&dir, block+offset, sizeof(dir));
-                if (dir.rec_len == 0) {
-                        break;
-                }
-                if (dir.name_len == strlen(childname) && strncmp(childname, dir.name, dir.name_len) == 0) {
-                        child_inode = dir.inode;
-                        memcpy(ret, &dir, sizeof(dir));
-                        break;
-                }
-                offset += dir.rec_len;
-        }
-        free(block);
-
-        return child_inode;
-}
-
-static int find_child(partition_t *pt, struct ext2_dir_entry_2 *parent, char *childname, struct ext2_dir_entry_2 *ret)
-{
-        slice_t *slice = get_blocks(pt, parent->inode);
-
-        int child_inode = 0;
-        for (int i = 0; i < slice->len; i++) {
-                //print_slice(slice);
-                int block_id;
-                get(slice, i, &block_id);
-                child_inode = find_child_in_block(pt, block_id, childname, ret);
-                if (child_inode != 0) {
-                        break;
-                }
-        }
-        delete_slice(slice);
-        return child_inode;
-}
-
 int search_file(partition_t *pt, char *path, struct ext2_dir_entry_2 *ret)
 {
         char *saveptr;
@@ -282,7 +223,7 @@ int search_file(partition_t *pt, char *path, struct ext2_dir_entry_2 *ret)
                         break;
                 }
 
-                ret_inode = find_child(pt, &dir, token, ret);
+                ret_inode = lookup_child(pt, dir.inode, token, strlen(token), ret);
                 if (ret_inode == 0) {
                         printf("not found\n");
                         break;
@@ -360,7 +301,7 @@ int print_part2(disk_t *disk)
         return 0;
 }
 
-int print_child_dirs(partition_t *pt, int inode_id)
+int print_child_dirs(FILE *out, partition_t *pt, int inode_id)
 {
         slice_t *s = get_child_dirs(pt, inode_id);
         struct ext2_dir_entry_2 dir;
@@ -370,7 +311,7 @@ int print_child_dirs(partition_t *pt, int inode_id)
                 get(s, i, &dir);
                 strncpy(name, dir.name, dir.name_len);
                 name[dir.name_len] = 0;
-                printf("%s ", name);
+                fprintf(out, "%s ", name);
         }
 
         delete_slice(s);
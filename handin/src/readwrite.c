@@ -7,6 +7,8 @@
  *
  * author: YOUR NAME HERE
  */
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>     /* for memcpy() */
@@ -16,17 +18,87 @@
 #include <unistd.h>
 #include <inttypes.h>
 
+#include "backend.h"
+#include "chunked.h"
+#include "overlay.h"
+#include "plan.h"
+
 #if defined(__FreeBSD__)
-#define lseek64 lseek
+#define pread64 pread
+#define pwrite64 pwrite
 #endif
 
-/* linux: lseek64 declaration needed here to eliminate compiler warning. */
-extern int64_t lseek64(int, int64_t, int);
-
 const unsigned int sector_size_bytes = 512;
 
 int device;  /* disk file descriptor */
 
+/* the backend the image is read and written through */
+static const backend_t *io = &pread_backend;
+
+/* open_backend: serve the image at fd by a backend.
+ *
+ * inputs:
+ *   char *name: the backend asked for, pread, mmap or memory.
+ *   int fd: the opened image.
+ *
+ * outputs:
+ *   0, -1 when there is no such backend or it cannot serve fd.
+ *
+ * a chunked image is always read by its own backend.
+ */
+int open_backend(const char *name, int fd)
+{
+        const backend_t *b = find_backend(name);
+
+        if (chunked_backend.open(fd) == 0) {
+                io = &chunked_backend;
+                return 0;
+        }
+        if (!b || b->open(fd) < 0) {
+                return -1;
+        }
+        io = b;
+        return 0;
+}
+
+/* stack_overlay_backend: send writes to the open overlay from now on and
+ * read the sectors it has from it. */
+void stack_overlay_backend(void)
+{
+        io = overlay_backend_over(io);
+}
+
+void close_backend(void)
+{
+        io->close();
+        io = &pread_backend;
+}
+
+int64_t disk_sector_count(void)
+{
+        return io->size();
+}
+
+/* image_backend: the backend the image is read and written through, for
+ * code that writes the repair plan out itself. Sectors go straight to it,
+ * the plan is neither read nor recorded. */
+const backend_t *image_backend(void)
+{
+        return io;
+}
+
+/* hint_sectors: tell the backend how a range is going to be read. */
+void hint_sectors(int64_t start_sector, int64_t num_sectors, int advice)
+{
+        io->hint(start_sector, num_sectors, advice);
+}
+
+/* flush_sectors: make the sectors written so far durable. */
+int flush_sectors(void)
+{
+        return io->flush();
+}
+
 /* print_sector: print the contents of a buffer containing one sector.
  *
  * inputs:
@@ -57,43 +129,30 @@ void print_sector (unsigned char *buf)
  *   int64 start_sector: the starting sector number to read.
  *                       sector numbering starts with 0.
  *   int numsectors: the number of sectors to read.  must be >= 1.
- *   int device [GLOBAL]: the disk from which to read.
  *
  * outputs:
  *   void *into: the requested number of sectors are copied into here.
  *
  * modifies:
  *   void *into
+ *
+ * reads through the backend the image was opened with, every one lets
+ * several threads read at once. Sectors with a planned write read as
+ * planned.
  */
-
 void read_sectors (int64_t start_sector, unsigned int num_sectors, void *into)
 {
-        ssize_t ret;
-        int64_t lret;
-        int64_t sector_offset;
-        ssize_t bytes_to_read;
-
-        if (num_sectors == 1) {
-                //printf("Reading sector %"PRId64"\n", start_sector);
-        } else {
-                //printf("Reading sectors %"PRId64"--%"PRId64"\n",
-                //start_sector, start_sector + (num_sectors - 1));
-        }
-
-        sector_offset = start_sector * sector_size_bytes;
-
-        if ((lret = lseek64(device, sector_offset, SEEK_SET)) != sector_offset) {
-                fprintf(stderr, "Seek to position %"PRId64" failed: "
-                        "returned %"PRId64"\n", sector_offset, lret);
-                exit(-1);
-        }
-
-        bytes_to_read = sector_size_bytes * num_sectors;
+        io->read(start_sector, num_sectors, into);
+        plan_overlay(start_sector, num_sectors, into);
+}
 
-        if ((ret = read(device, into, bytes_to_read)) != bytes_to_read) {
-                fprintf(stderr, "Read sector %"PRId64" length %d failed: "
-                        "returned %"PRId64"\n", start_sector, num_sectors, ret);
-                exit(-1);
+/* read_sectors_v: read several ranges in one call, which the backend may
+ * turn into fewer requests. */
+void read_sectors_v (sector_run_t *runs, int count)
+{
+        io->readv(runs, count);
+        for (int i = 0; i < count; i++) {
+                plan_overlay(runs[i].start_sector, runs[i].num_sectors, runs[i].buf);
         }
 }
 
@@ -106,41 +165,18 @@ void read_sectors (int64_t start_sector, unsigned int num_sectors, void *into)
  *   int numsectors: the number of sectors to write.  must be >= 1.
  *   void *from: the requested number of sectors are copied from here.
  *
- * outputs:
- *   int device [GLOBAL]: the disk into which to write.
- *
  * modifies:
- *   int device [GLOBAL]
+ *   the image, through its backend
+ *
+ * while a repair plan is active the write is recorded in it instead.
  */
 void write_sectors (int64_t start_sector, unsigned int num_sectors, void *from)
 {
-        ssize_t ret;
-        int64_t lret;
-        int64_t sector_offset;
-        ssize_t bytes_to_write;
-
-        //if (num_sectors == 1) {
-        //        printf("Reading sector  %"PRId64"\n", start_sector);
-        //} else {
-        //        printf("Reading sectors %"PRId64"--%"PRId64"\n",
-        //               start_sector, start_sector + (num_sectors - 1));
-        //}
-
-        sector_offset = start_sector * sector_size_bytes;
-
-        if ((lret = lseek64(device, sector_offset, SEEK_SET)) != sector_offset) {
-                fprintf(stderr, "Seek to position %"PRId64" failed: "
-                        "returned %"PRId64"\n", sector_offset, lret);
-                exit(-1);
-        }
-
-        bytes_to_write = sector_size_bytes * num_sectors;
-
-        if ((ret = write(device, from, bytes_to_write)) != bytes_to_write) {
-                fprintf(stderr, "Write sector %"PRId64" length %d failed: "
-                        "returned %"PRId64"\n", start_sector, num_sectors, ret);
-                exit(-1);
+        if (plan_active()) {
+                plan_record(start_sector, num_sectors, from);
+                return;
         }
+        io->write(start_sector, num_sectors, from);
 }
 
 int open_read_close_sect(char *disk, int start_sect, int num_sectors, char *buf)
@@ -150,7 +186,9 @@ int open_read_close_sect(char *disk, int start_sect, int num_sectors, char *buf)
                 perror("Could not open device file");
                 return -1;
         }
+        open_backend("pread", device);
         read_sectors(start_sect, num_sectors, buf);
+        close_backend();
         close(device);
         
         return 0;
@@ -176,11 +214,13 @@ int main (int argc, char **argv)
                 exit(-1);
         }
 
+        open_backend("pread", device);
         the_sector = atoi(argv[2]);
         printf("Dumping sector %d:\n", the_sector);
         read_sectors(the_sector, 1, buf);
         print_sector(buf);
 
+        close_backend();
         close(device);
         return 0;
 }
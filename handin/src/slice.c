@@ -36,7 +36,7 @@ int append(slice_t *s, void *item)
         }
 
         // realloc
-        s->array = realloc(s->array, s->item_size * 1024);
+        s->array = realloc(s->array, s->item_size * (s->cap + 1024));
         if (!s->array) {
                 error_at_line(-1, errno, __FILE__, __LINE__, NULL);
         }
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "spill.h"
+
+// a region of the spill file mapped into memory
+typedef struct mapping_s {
+        char *addr;
+        size_t len;
+        off_t offset;
+        struct mapping_s *next;
+} mapping_t;
+
+// heap bytes allowed before allocations move to the spill file, 0 for no limit
+static long long heap_budget = 0;
+static long long heap_used = 0;
+
+static int spill_fd = -1;
+static off_t spill_end = 0;
+static mapping_t *mappings = NULL;
+
+int spill_init(long long budget)
+{
+        heap_budget = budget;
+        heap_used = 0;
+        return 0;
+}
+
+static int open_spill_file(void)
+{
+        const char *dir = getenv("TMPDIR");
+        char path[4096];
+
+        snprintf(path, sizeof(path), "%s/myfsck-spill-XXXXXX", dir ? dir : "/tmp");
+        spill_fd = mkstemp(path);
+        if (spill_fd < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+        }
+        // the file lives as long as the descriptor
+        unlink(path);
+
+        return 0;
+}
+
+// map a zeroed region at the end of the spill file, the kernel pages it
+// out under memory pressure instead of it counting against the heap
+static void *spill_map(size_t len)
+{
+        long page_size = sysconf(_SC_PAGESIZE);
+        len = (len + page_size - 1) / page_size * page_size;
+
+        if (spill_fd < 0) {
+                open_spill_file();
+        }
+        if (ftruncate(spill_fd, spill_end + len) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        char *addr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, spill_fd, spill_end);
+        if (addr == MAP_FAILED) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        mapping_t *m = malloc(sizeof(mapping_t));
+        if (!m) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        m->addr = addr;
+        m->len = len;
+        m->offset = spill_end;
+        m->next = mappings;
+        mappings = m;
+
+        spill_end += len;
+        return addr;
+}
+
+// calloc within the heap budget, falling back to the spill file past it
+void *spill_calloc(size_t count, size_t size)
+{
+        size_t len = count * size;
+
+        if (heap_budget == 0 || heap_used + (long long)len <= heap_budget) {
+                void *ptr = calloc(count, size);
+                if (!ptr) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                heap_used += len;
+                return ptr;
+        }
+        return spill_map(len);
+}
+
+void spill_free(void *ptr, size_t size)
+{
+        if (!ptr) {
+                return;
+        }
+
+        for (mapping_t **m = &mappings; *m; m = &(*m)->next) {
+                if ((*m)->addr != ptr) {
+                        continue;
+                }
+                mapping_t *found = *m;
+                munmap(found->addr, found->len);
+#ifdef FALLOC_FL_PUNCH_HOLE
+                // give the disk space back, the offset is never reused
+                fallocate(spill_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, found->offset, found->len);
+#endif
+                *m = found->next;
+                free(found);
+                return;
+        }
+
+        free(ptr);
+        heap_used -= size;
+}
+
+void spill_close(void)
+{
+        while (mappings) {
+                mapping_t *m = mappings;
+                munmap(m->addr, m->len);
+                mappings = m->next;
+                free(m);
+        }
+        if (spill_fd >= 0) {
+                close(spill_fd);
+                spill_fd = -1;
+        }
+        spill_end = 0;
+}
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <error.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "link_list.h"
+#include "slice.h"
+#include "traverse.h"
+#include "util/bitmap.h"
+#include "util/partition.h"
+
+// a double ended queue of directories, the owner works at the tail and
+// thieves take from the head, where the oldest and largest subtrees are
+typedef struct deque_s {
+        pthread_mutex_t lock;
+        int *items;
+        int head;
+        int tail;
+        int cap;
+} deque_t;
+
+typedef struct search_s {
+        partition_t *pt;
+        int (*func)(partition_t*, int);
+        void (*revisit)(partition_t*, int, int);
+        char *visited;
+
+        int worker_count;
+        deque_t *deques;
+
+        // directories queued or being read, the search ends at zero
+        int pending;
+} search_t;
+
+typedef struct worker_s {
+        search_t *search;
+        int id;
+} worker_t;
+
+static __thread int worker_id;
+
+// the index of the worker running the calling thread, 0 outside a search
+int traverse_worker_id(void)
+{
+        return worker_id;
+}
+
+static void deque_init(deque_t *d)
+{
+        pthread_mutex_init(&d->lock, NULL);
+        d->cap = 1024;
+        d->head = 0;
+        d->tail = 0;
+        d->items = malloc(sizeof(int) * d->cap);
+        if (!d->items) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+}
+
+static void deque_destroy(deque_t *d)
+{
+        pthread_mutex_destroy(&d->lock);
+        free(d->items);
+}
+
+static void deque_push(deque_t *d, int item)
+{
+        pthread_mutex_lock(&d->lock);
+        if (d->tail == d->cap) {
+                if (d->head > 0) {
+                        // reuse the room left by stolen items
+                        memmove(d->items, d->items + d->head, sizeof(int) * (d->tail - d->head));
+                        d->tail -= d->head;
+                        d->head = 0;
+                } else {
+                        d->cap *= 2;
+                        d->items = realloc(d->items, sizeof(int) * d->cap);
+                        if (!d->items) {
+                                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                        }
+                }
+        }
+        d->items[d->tail++] = item;
+        pthread_mutex_unlock(&d->lock);
+}
+
+// take from the tail, the owner's end
+static int deque_pop(deque_t *d, int *item)
+{
+        int found = 0;
+
+        pthread_mutex_lock(&d->lock);
+        if (d->tail > d->head) {
+                *item = d->items[--d->tail];
+                found = 1;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        return found;
+}
+
+// take from the head, the thieves' end
+static int deque_steal(deque_t *d, int *item)
+{
+        int found = 0;
+
+        if (pthread_mutex_trylock(&d->lock) != 0) {
+                return 0;
+        }
+        if (d->tail > d->head) {
+                *item = d->items[d->head++];
+                found = 1;
+        }
+        pthread_mutex_unlock(&d->lock);
+
+        return found;
+}
+
+static int find_work(worker_t *w, int *item)
+{
+        search_t *s = w->search;
+
+        if (deque_pop(&s->deques[w->id], item)) {
+                return 1;
+        }
+        for (int i = 1; i < s->worker_count; i++) {
+                if (deque_steal(&s->deques[(w->id + i) % s->worker_count], item)) {
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+static void visit_dir(worker_t *w, int inode_id)
+{
+        search_t *s = w->search;
+        partition_t *pt = s->pt;
+
+        if (s->func) {
+                s->func(pt, inode_id);
+        }
+
+        slice_t *children = get_child_inodes(pt, inode_id);
+
+        int c_id;
+        for (int i = 2; i < children->len; i++) {
+                get(children, i, &c_id);
+                if (!is_valid_inode(pt, c_id) || !is_dir(pt, c_id)) {
+                        continue;
+                }
+                if (test_and_set_bit(s->visited, c_id)) {
+                        if (s->revisit) {
+                                s->revisit(pt, inode_id, c_id);
+                        }
+                        continue;
+                }
+                __atomic_fetch_add(&s->pending, 1, __ATOMIC_RELAXED);
+                deque_push(&s->deques[w->id], c_id);
+        }
+        delete_slice(children);
+}
+
+static void *search_worker(void *arg)
+{
+        worker_t *w = arg;
+        search_t *s = w->search;
+        int inode_id;
+
+        worker_id = w->id;
+        for (;;) {
+                if (find_work(w, &inode_id)) {
+                        if (is_valid_inode(s->pt, inode_id)) {
+                                visit_dir(w, inode_id);
+                        }
+                        // children are counted before their parent is done
+                        __atomic_fetch_sub(&s->pending, 1, __ATOMIC_RELEASE);
+                        continue;
+                }
+                if (__atomic_load_n(&s->pending, __ATOMIC_ACQUIRE) == 0) {
+                        break;
+                }
+                sched_yield();
+        }
+        worker_id = 0;
+
+        return NULL;
+}
+
+// search the directories below the queued ones with several workers, each
+// owning a deque and stealing from the others when it runs dry. The
+// caller marks the queued inodes in visited, a directory reached again is
+// passed to revisit instead of being queued twice. func may be called from
+// any worker at the same time.
+int parallel_search(list_t *queue, partition_t *pt,
+                    int (*func)(partition_t*, int),
+                    void (*revisit)(partition_t*, int, int),
+                    char *visited, int workers)
+{
+        search_t s;
+        s.pt = pt;
+        s.func = func;
+        s.revisit = revisit;
+        s.visited = visited;
+        s.worker_count = workers;
+        s.pending = 0;
+
+        s.deques = malloc(sizeof(deque_t) * workers);
+        worker_t *w = malloc(sizeof(worker_t) * workers);
+        pthread_t *threads = malloc(sizeof(pthread_t) * workers);
+        if (!s.deques || !w || !threads) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        for (int i = 0; i < workers; i++) {
+                deque_init(&s.deques[i]);
+                w[i].search = &s;
+                w[i].id = i;
+        }
+
+        // spread the seeds over the workers
+        int inode_id;
+        for (int i = 0; queue->len > 0; i++) {
+                ll_pop(queue, &inode_id);
+                deque_push(&s.deques[i % workers], inode_id);
+                s.pending++;
+        }
+
+        // the calling thread is the first worker
+        for (int i = 1; i < workers; i++) {
+                int err = pthread_create(&threads[i], NULL, search_worker, &w[i]);
+                if (err) {
+                        error_at_line(-1, err, __FILE__, __LINE__, NULL);
+                }
+        }
+        search_worker(&w[0]);
+        for (int i = 1; i < workers; i++) {
+                pthread_join(threads[i], NULL);
+        }
+
+        for (int i = 0; i < workers; i++) {
+                deque_destroy(&s.deques[i]);
+        }
+        free(s.deques);
+        free(w);
+        free(threads);
+
+        return 0;
+}
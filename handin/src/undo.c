@@ -0,0 +1,236 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <error.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "undo.h"
+
+#define UNDO_MAGIC "MYFSUNDO"
+#define UNDO_VERSION 2
+
+// the log is complete once every original it holds is on disk, and
+// applied once the repairs it covers were synced as well
+#define UNDO_OPEN 0
+#define UNDO_COMPLETE 1
+#define UNDO_APPLIED 2
+
+extern const unsigned int sector_size_bytes;
+
+// header of an undo log, followed by its records
+typedef struct undo_header_s {
+        char magic[8];
+        uint32_t version;
+        uint32_t sector_size;
+        uint32_t state;
+        uint32_t reserved;
+        uint64_t record_count;
+} undo_header_t;
+
+// one run of sectors, followed by their contents before the repair. The
+// crc32 covers the record, taken with crc at zero, and the contents.
+typedef struct undo_record_s {
+        uint64_t start_sector;
+        uint32_t num_sectors;
+        uint32_t crc;
+} undo_record_t;
+
+static FILE *log_file = NULL;
+static undo_header_t header;
+
+static uint32_t record_crc(undo_record_t record, const void *from)
+{
+        record.crc = 0;
+        uLong crc = crc32(0L, Z_NULL, 0);
+        crc = crc32(crc, (const Bytef *)&record, sizeof(record));
+        crc = crc32(crc, from, record.num_sectors * sector_size_bytes);
+        return crc;
+}
+
+static void write_header(void)
+{
+        if (fseek(log_file, 0, SEEK_SET) < 0
+            || fwrite(&header, sizeof(header), 1, log_file) != 1
+            || fseek(log_file, 0, SEEK_END) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+}
+
+// start an undo log, the originals of the sectors about to be written are
+// appended to it before any of them is
+int undo_open(const char *path)
+{
+        log_file = fopen(path, "w+b");
+        if (!log_file) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+        }
+
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, UNDO_MAGIC, sizeof(header.magic));
+        header.version = UNDO_VERSION;
+        header.sector_size = sector_size_bytes;
+        header.state = UNDO_OPEN;
+        write_header();
+
+        return 0;
+}
+
+void undo_append(int64_t start_sector, unsigned int num_sectors, const void *from)
+{
+        undo_record_t record;
+        memset(&record, 0, sizeof(record));
+        record.start_sector = start_sector;
+        record.num_sectors = num_sectors;
+        record.crc = record_crc(record, from);
+
+        if (fwrite(&record, sizeof(record), 1, log_file) != 1
+            || fwrite(from, sector_size_bytes, num_sectors, log_file) != num_sectors) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        header.record_count++;
+}
+
+static void sync_log(void)
+{
+        if (fflush(log_file) != 0 || fsync(fileno(log_file)) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+}
+
+// the sync point before the repairs, every original is on disk after it
+void undo_sync(void)
+{
+        header.state = UNDO_COMPLETE;
+        write_header();
+        sync_log();
+}
+
+// the sync point after the repairs were synced
+void undo_close(void)
+{
+        header.state = UNDO_APPLIED;
+        write_header();
+        sync_log();
+        fclose(log_file);
+        log_file = NULL;
+}
+
+// read the next record and its contents into *buf, growing it. Returns -1
+// when the log ends early or the record fails its checksum.
+static int read_record(FILE *f, off_t size, undo_record_t *record, char **buf)
+{
+        if (fread(record, sizeof(*record), 1, f) != 1) {
+                return -1;
+        }
+        size_t bytes = (size_t)record->num_sectors * sector_size_bytes;
+        if (bytes > size - ftello(f)) {
+                return -1;
+        }
+        *buf = realloc(*buf, bytes ? bytes : 1);
+        if (!*buf) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+        if (fread(*buf, sector_size_bytes, record->num_sectors, f) != record->num_sectors
+            || record_crc(*record, *buf) != record->crc) {
+                return -1;
+        }
+        return 0;
+}
+
+// write the originals of an undo log back to fd, returns the number of
+// sectors restored or -1 when the log is not usable. Every record is
+// checked before the first sector is written, a damaged log changes
+// nothing.
+int undo_replay(const char *path, int fd)
+{
+        FILE *f = fopen(path, "rb");
+        if (!f) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+        }
+
+        undo_header_t h;
+        if (fread(&h, sizeof(h), 1, f) != 1
+            || memcmp(h.magic, UNDO_MAGIC, sizeof(h.magic)) != 0
+            || h.version != UNDO_VERSION || h.sector_size != sector_size_bytes) {
+                fclose(f);
+                return -1;
+        }
+        if (h.state == UNDO_OPEN) {
+                // the repairs never started, the image is as it was
+                fclose(f);
+                return 0;
+        }
+
+        struct stat st;
+        if (fstat(fileno(f), &st) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+        }
+
+        undo_record_t record;
+        char *buf = NULL;
+        for (uint64_t i = 0; i < h.record_count; i++) {
+                if (read_record(f, st.st_size, &record, &buf) < 0) {
+                        free(buf);
+                        fclose(f);
+                        return -1;
+                }
+        }
+
+        int restored = 0;
+        if (fseeko(f, sizeof(h), SEEK_SET) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", path);
+        }
+        for (uint64_t i = 0; i < h.record_count; i++) {
+                if (read_record(f, st.st_size, &record, &buf) < 0) {
+                        // changed since it was checked
+                        error_at_line(-1, 0, __FILE__, __LINE__, "%s changed during the replay", path);
+                }
+                size_t bytes = (size_t)record.num_sectors * sector_size_bytes;
+                if (pwrite(fd, buf, bytes, (off_t)record.start_sector * sector_size_bytes) != bytes) {
+                        error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+                }
+                restored += record.num_sectors;
+        }
+        if (restored > 0 && fdatasync(fd) < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, NULL);
+        }
+
+        free(buf);
+        fclose(f);
+        return restored;
+}
+
+#ifdef UNDOREPLAY
+
+const unsigned int sector_size_bytes = 512;
+
+int main(int argc, char *argv[])
+{
+        if (argc != 3) {
+                printf("usage: %s /path/to/undo/file /path/to/disk/image\n", argv[0]);
+                return -1;
+        }
+
+        int fd = open(argv[2], O_RDWR);
+        if (fd < 0) {
+                error_at_line(-1, errno, __FILE__, __LINE__, "%s", argv[2]);
+        }
+
+        int restored = undo_replay(argv[1], fd);
+        close(fd);
+        if (restored < 0) {
+                printf("%s is not a usable undo file\n", argv[1]);
+                return -1;
+        }
+        printf("Restored %d sectors from %s\n", restored, argv[1]);
+
+        return 0;
+}
+
+#endif
@@ -0,0 +1,163 @@
+#define _GNU_SOURCE
+
+#include <error.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "writeback.h"
+
+// runs queued at most, a power of two
+#define WRITEBACK_QUEUE_SIZE 256
+
+// a run of sectors the writer owns until it is on disk
+typedef struct wb_item_s {
+        int64_t start_sector;
+        unsigned int num_sectors;
+        char *buf;
+} wb_item_t;
+
+// a bounded lock-free queue after Dmitry Vyukov's, each cell carries the
+// position it may next be written at, or read at once it is one past it
+typedef struct wb_cell_s {
+        size_t sequence;
+        wb_item_t item;
+} wb_cell_t;
+
+static wb_cell_t cells[WRITEBACK_QUEUE_SIZE];
+static size_t enqueue_pos;
+static size_t dequeue_pos;
+
+static int active = 0;
+static const backend_t *device = NULL;
+static pthread_t writer;
+static sem_t queued; // items in the queue, the writer sleeps on it
+static int stopping = 0;
+static int submitted = 0;
+static int written = 0;
+
+static int enqueue(wb_item_t *item)
+{
+        size_t pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+                wb_cell_t *cell = &cells[pos & (WRITEBACK_QUEUE_SIZE - 1)];
+                size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+                intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 1,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                                cell->item = *item;
+                                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                                return 1;
+                        }
+                } else if (diff < 0) {
+                        return 0; // full
+                } else {
+                        pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+                }
+        }
+}
+
+static int dequeue(wb_item_t *item)
+{
+        size_t pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+        for (;;) {
+                wb_cell_t *cell = &cells[pos & (WRITEBACK_QUEUE_SIZE - 1)];
+                size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+                intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+                if (diff == 0) {
+                        if (__atomic_compare_exchange_n(&dequeue_pos, &pos, pos + 1, 1,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                                *item = cell->item;
+                                __atomic_store_n(&cell->sequence, pos + WRITEBACK_QUEUE_SIZE, __ATOMIC_RELEASE);
+                                return 1;
+                        }
+                } else if (diff < 0) {
+                        return 0; // empty
+                } else {
+                        pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+                }
+        }
+}
+
+static void *writer_main(void *arg)
+{
+        wb_item_t item;
+
+        for (;;) {
+                sem_wait(&queued);
+                if (!dequeue(&item)) {
+                        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+                                break;
+                        }
+                        continue;
+                }
+                device->write(item.start_sector, item.num_sectors, item.buf);
+                free(item.buf);
+                __atomic_fetch_add(&written, 1, __ATOMIC_RELEASE);
+        }
+
+        return NULL;
+}
+
+// start the thread writing queued runs through io in the order they come
+int writeback_start(const backend_t *io)
+{
+        for (size_t i = 0; i < WRITEBACK_QUEUE_SIZE; i++) {
+                cells[i].sequence = i;
+        }
+        enqueue_pos = 0;
+        dequeue_pos = 0;
+        device = io;
+        stopping = 0;
+        submitted = 0;
+        written = 0;
+        sem_init(&queued, 0, 0);
+
+        int err = pthread_create(&writer, NULL, writer_main, NULL);
+        if (err) {
+                error_at_line(-1, err, __FILE__, __LINE__, NULL);
+        }
+        active = 1;
+
+        return 0;
+}
+
+int writeback_active(void)
+{
+        return active;
+}
+
+// hand a run to the writer, which frees buf once it is written. Waits
+// while the queue is full.
+void writeback_submit(int64_t start_sector, unsigned int num_sectors, char *buf)
+{
+        wb_item_t item = {start_sector, num_sectors, buf};
+
+        while (!enqueue(&item)) {
+                sched_yield();
+        }
+        submitted++;
+        sem_post(&queued);
+}
+
+// wait for every queued run, sync the device once and stop the writer.
+// Returns the number of runs written.
+int writeback_finish(void)
+{
+        if (!active) {
+                return 0;
+        }
+        __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+        sem_post(&queued);
+        pthread_join(writer, NULL);
+        sem_destroy(&queued);
+        active = 0;
+
+        if (submitted > 0) {
+                device->flush();
+        }
+        return written;
+}